@@ -0,0 +1,769 @@
+/*
+ * Copyright (c) 2023-2024 Laurent Cheylus <foxy@free.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Performance regression gate, run by `make perf-check`.
+ *
+ * The microbenchmarks drive the protocol translation code (icb_recv(),
+ * irc_recv()) and the TOML parser directly, writing all output to
+ * /dev/null. The end-to-end scenario starts the real icbirc binary
+ * between a fake ICB server and a fake IRC client on the loopback
+ * interface, measures message throughput from server to client and
+ * the round trip time of messages bounced client -> server -> client.
+ *
+ * Results are compared against a baseline (TOML) and written as JSON.
+ * The exit status is non-zero if any figure regressed beyond the
+ * tolerance. The figures are absolute and only comparable on the same
+ * machine: -w writes them as a new baseline (`make perf-baseline`).
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <bsd/string.h>
+#include "icb.h"
+#include "irc.h"
+#include "toml.h"
+
+#ifndef GIT_COMMIT
+#define GIT_COMMIT "devel"
+#endif
+
+#define BENCH_ROUNDS	5	/* microbenchmark repetitions, best is kept */
+#define E2E_MESSAGES	20000	/* messages in the throughput phase */
+#define E2E_ROUNDTRIPS	2000	/* messages in the latency phase */
+#define E2E_TIMEOUT	10000	/* ms without progress before giving up */
+
+int		 sync_write(int, const char *, int);
+static void	 usage(void);
+static double	 now(void);
+static double	 bench_icb_recv(void);
+static double	 bench_irc_recv(void);
+static char	*bench_toml_conf(int, int, size_t *);
+static double	 bench_toml_parse(void);
+static int	 bench_toml_event(void *, const toml_event_t *);
+static double	 bench_toml_events(void);
+static double	 bench_toml_file(int);
+static int	 e2e_run(const char *, double *, double *, double *);
+static void	 e2e_server(int);
+static int	 e2e_readline(int, char *, size_t, char *, size_t *);
+static int	 cmp_double(const void *, const void *);
+
+int terminate_client;
+static int null_fd = -1;
+
+/* measured figures, in the order they are reported */
+enum { r_icb_recv, r_irc_recv, r_toml_parse, r_toml_events, r_toml_file,
+    r_toml_stream, r_toml_cached, r_e2e_msgs, r_e2e_p50, r_e2e_p99, r_max };
+
+/* how bench_toml_file() loads the configuration */
+enum { tf_file, tf_stream, tf_cached };
+
+static const struct {
+	const char	*name;		/* key in results and baseline */
+	const char	*unit;
+	int		 higher_is_better;
+} results[r_max] = {
+	{ "icb_recv",		"packets/s",	1 },
+	{ "irc_recv",		"lines/s",	1 },
+	{ "toml_parse",		"bytes/s",	1 },
+	{ "toml_events",	"bytes/s",	1 },
+	{ "toml_file",		"bytes/s",	1 },
+	{ "toml_stream",	"bytes/s",	1 },
+	{ "toml_cached",	"bytes/s",	1 },
+	{ "e2e_throughput",	"msgs/s",	1 },
+	{ "e2e_rtt_p50",	"us",		0 },
+	{ "e2e_rtt_p99",	"us",		0 },
+};
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-b baseline] [-o output] [-t tolerance] "
+	    "[-w baseline] -x icbirc\n", __progname);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+int
+sync_write(int fd, const char *buf, int len)
+{
+	return (write(fd, buf, len) != len);
+}
+
+static double
+bench_icb_recv(void)
+{
+	static const char payload[] = "sender\001"
+	    "a reasonably sized open message, as seen on busy groups";
+	char *buf;
+	unsigned len = 0, i, n = 50000;
+	double best = 0.0;
+	int round;
+
+	buf = malloc(n * (sizeof(payload) + 2));
+	if (buf == NULL)
+		return (0.0);
+	for (i = 0; i < n; ++i) {
+		buf[len++] = 1 + sizeof(payload); /* 'b' + payload + NUL */
+		buf[len++] = 'b';
+		memcpy(buf + len, payload, sizeof(payload));
+		len += sizeof(payload);
+	}
+
+	strlcpy(irc_nick, "bench", sizeof(irc_nick));
+	strlcpy(irc_channel, "#bench", sizeof(irc_channel));
+	for (round = 0; round < BENCH_ROUNDS; ++round) {
+		double t;
+
+		icb_init();
+		in_irc_channel = 1;
+		t = now();
+		icb_recv(buf, len, null_fd, null_fd);
+		t = now() - t;
+		if (n / t > best)
+			best = n / t;
+	}
+	free(buf);
+	return (best);
+}
+
+static double
+bench_irc_recv(void)
+{
+	static const char line[] = "PRIVMSG #bench :a reasonably sized open "
+	    "message, as typed on busy groups\r\n";
+	char *buf;
+	unsigned len = 0, i, n = 50000;
+	double best = 0.0;
+	int round;
+
+	buf = malloc(n * (sizeof(line) - 1));
+	if (buf == NULL)
+		return (0.0);
+	for (i = 0; i < n; ++i) {
+		memcpy(buf + len, line, sizeof(line) - 1);
+		len += sizeof(line) - 1;
+	}
+
+	strlcpy(irc_channel, "#bench", sizeof(irc_channel));
+	for (round = 0; round < BENCH_ROUNDS; ++round) {
+		double t;
+
+		t = now();
+		irc_recv(buf, len, null_fd, null_fd);
+		t = now() - t;
+		if (n / t > best)
+			best = n / t;
+	}
+	free(buf);
+	return (best);
+}
+
+/*
+ * Configuration with one table per user, each with a text block of
+ * motd bytes if non-zero.
+ */
+static char *
+bench_toml_conf(int users, int motd, size_t *lenp)
+{
+	char *conf;
+	size_t len = 0, siz = users * (128 + motd + motd / 64) + 128;
+	int i, j;
+
+	if ((conf = malloc(siz)) == NULL)
+		return (NULL);
+	len += snprintf(conf + len, siz - len, "[server]\n"
+	    "  name = \"default.icb.net\"\n  port = 7326\n\n");
+	for (i = 0; i < users && siz - len > 256 + motd + motd / 64; ++i) {
+		len += snprintf(conf + len, siz - len, "[user.u%d]\n"
+		    "  nick = \"nick%d\"\n  group = \"group%d\"\n"
+		    "  limit = %d\n  enabled = true\n", i, i, i % 37, i);
+		if (motd > 0) {
+			len += snprintf(conf + len, siz - len,
+			    "  motd = \"\"\"\n");
+			for (j = 0; j < motd; ++j)
+				conf[len++] = j % 64 == 63 ? '\n' :
+				    'a' + (i + j) % 26;
+			len += snprintf(conf + len, siz - len, "\"\"\"\n");
+		}
+		conf[len++] = '\n';
+	}
+	conf[len] = 0;
+	*lenp = len;
+	return (conf);
+}
+
+static double
+bench_toml_parse(void)
+{
+	char *conf, errbuf[256];
+	size_t len;
+	double best = 0.0;
+	int round;
+
+	if ((conf = bench_toml_conf(2000, 0, &len)) == NULL)
+		return (0.0);
+
+	for (round = 0; round < BENCH_ROUNDS; ++round) {
+		toml_table_t *tab;
+		double t;
+
+		t = now();
+		tab = toml_parse(conf, errbuf, sizeof(errbuf));
+		t = now() - t;
+		if (tab == NULL) {
+			fprintf(stderr, "toml_parse: %s\n", errbuf);
+			free(conf);
+			return (0.0);
+		}
+		toml_free(tab);
+		if (len / t > best)
+			best = len / t;
+	}
+	free(conf);
+	return (best);
+}
+
+/*
+ * The same configuration walked with toml_parse_events(), the handler
+ * only counting the values as a consumer streaming them into its own
+ * structures would look at them.
+ */
+static int
+bench_toml_event(void *arg, const toml_event_t *ev)
+{
+	if (ev->type == TOML_EVENT_KEYVAL)
+		*(int *)arg += ev->raw.len;
+	return (0);
+}
+
+static double
+bench_toml_events(void)
+{
+	char *conf, errbuf[256];
+	size_t len;
+	double best = 0.0;
+	int round;
+
+	if ((conf = bench_toml_conf(2000, 0, &len)) == NULL)
+		return (0.0);
+
+	for (round = 0; round < BENCH_ROUNDS; ++round) {
+		double t;
+		int n = 0;
+
+		t = now();
+		if (toml_parse_events(conf, bench_toml_event, &n, errbuf,
+		    sizeof(errbuf))) {
+			fprintf(stderr, "toml_parse_events: %s\n", errbuf);
+			free(conf);
+			return (0.0);
+		}
+		t = now() - t;
+		if (len / t > best)
+			best = len / t;
+	}
+	free(conf);
+	return (best);
+}
+
+/*
+ * Loading a configuration of several megabytes: with toml_parse_file()
+ * from a regular file (read at once) or from a stream without
+ * a file descriptor (read in growing chunks), or with toml_parse_cached()
+ * from its precompiled image.
+ */
+static double
+bench_toml_file(int mode)
+{
+	char *conf, errbuf[256], path[] = "/tmp/bench.XXXXXXXXXX";
+	char cache[sizeof(path) + 4];
+	size_t len;
+	double best = 0.0;
+	int fd, round;
+
+	if ((conf = bench_toml_conf(2000, 2048, &len)) == NULL)
+		return (0.0);
+	if (mode != tf_stream) {
+		if ((fd = mkstemp(path)) < 0) {
+			perror("mkstemp");
+			free(conf);
+			return (0.0);
+		}
+		if (write(fd, conf, len) != (ssize_t)len) {
+			perror(path);
+			best = -1.0;
+		}
+		close(fd);
+	}
+	snprintf(cache, sizeof(cache), "%s.img", path);
+	if (mode == tf_cached && best >= 0.0)
+		toml_free(toml_parse_cached(path, cache, errbuf,
+		    sizeof(errbuf)));
+
+	for (round = 0; round < BENCH_ROUNDS && best >= 0.0; ++round) {
+		toml_table_t *tab;
+		FILE *fp = NULL;
+		double t;
+
+		t = now();
+		if (mode == tf_stream)
+			fp = fmemopen(conf, len, "r");
+		else if (mode == tf_file)
+			fp = fopen(path, "r");
+		if (mode != tf_cached && fp == NULL) {
+			perror(mode == tf_stream ? "fmemopen" : path);
+			best = -1.0;
+			break;
+		}
+		if (fp != NULL) {
+			tab = toml_parse_file(fp, errbuf, sizeof(errbuf));
+			fclose(fp);
+		} else
+			tab = toml_parse_cached(path, cache, errbuf,
+			    sizeof(errbuf));
+		t = now() - t;
+		if (tab == NULL) {
+			fprintf(stderr, "toml_parse_file: %s\n", errbuf);
+			best = -1.0;
+			break;
+		}
+		toml_free(tab);
+		if (len / t > best)
+			best = len / t;
+	}
+	if (mode != tf_stream)
+		unlink(path);
+	if (mode == tf_cached)
+		unlink(cache);
+	free(conf);
+	return (best < 0.0 ? 0.0 : best);
+}
+
+/*
+ * Fake ICB server: answers the login, puts the client into group
+ * "bench", echoes open messages back and, on "go", sends a burst of
+ * E2E_MESSAGES open messages.
+ */
+static void
+e2e_server(int listen_fd)
+{
+	unsigned char pkt[256], out[256 * 64];
+	unsigned off = 0, olen;
+	int fd, i;
+	ssize_t len;
+
+	if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+		_exit(1);
+	/* protocol packet: level, host id, server id */
+	olen = snprintf((char *)out + 1, sizeof(out) - 1,
+	    "j1\001bench\001benchd") + 1;
+	out[0] = olen - 1;
+	write(fd, out, olen);
+
+	while ((len = read(fd, pkt + off, off ? pkt[0] + 1 - off : 1)) > 0) {
+		off += len;
+		if (off < 1 || off < (unsigned)pkt[0] + 1)
+			continue;
+		off = 0;
+		if (pkt[1] == 'a') {
+			olen = 0;
+			out[olen++] = 1;
+			out[olen++] = 'a';
+			i = snprintf((char *)out + olen + 1,
+			    sizeof(out) - olen - 1, "dStatus\001You are now "
+			    "in group bench");
+			out[olen] = i;
+			olen += i + 1;
+			write(fd, out, olen);
+		} else if (pkt[1] == 'b' && pkt[0] == 4 &&
+		    !memcmp(pkt + 2, "go", 2)) {
+			unsigned n = 0;
+
+			while (n < E2E_MESSAGES) {
+				for (olen = 0; olen < sizeof(out) - 256 &&
+				    n < E2E_MESSAGES; ++n) {
+					i = snprintf((char *)out + olen + 1,
+					    256, "bpeer\001burst %u", n);
+					out[olen] = i + 1;
+					olen += i + 2;
+				}
+				if (write(fd, out, olen) != (ssize_t)olen)
+					_exit(1);
+			}
+		} else if (pkt[1] == 'b') {
+			/* echo the text back as an open message from peer */
+			olen = pkt[0] - 1;
+			out[1] = 'b';
+			memcpy(out + 2, "peer\001", 5);
+			memcpy(out + 7, pkt + 2, olen);
+			out[0] = olen + 6;
+			write(fd, out, olen + 7);
+		}
+		/* anything else, e.g. the NAMES query, is ignored */
+	}
+	_exit(0);
+}
+
+/*
+ * Read one line (without CR LF) from fd into line, buffering the
+ * remainder in buf. Returns 0 on success, -1 on error or timeout.
+ */
+static int
+e2e_readline(int fd, char *line, size_t siz, char *buf, size_t *off)
+{
+	char *nl;
+
+	while ((nl = memchr(buf, '\n', *off)) == NULL) {
+		struct pollfd pfd;
+		ssize_t len;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, E2E_TIMEOUT) <= 0)
+			return (-1);
+		len = read(fd, buf + *off, 65536 - *off);
+		if (len <= 0)
+			return (-1);
+		*off += len;
+	}
+	*nl = 0;
+	if (nl > buf && nl[-1] == '\r')
+		nl[-1] = 0;
+	strlcpy(line, buf, siz);
+	*off -= nl + 1 - buf;
+	memmove(buf, nl + 1, *off);
+	return (0);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static int
+e2e_run(const char *icbirc, double *msgs, double *p50, double *p99)
+{
+	struct sockaddr_in sa;
+	socklen_t len;
+	char port_icb[8], port_irc[8], line[1024], *buf;
+	size_t off = 0;
+	double t, *rtt = NULL;
+	pid_t server = -1, proxy = -1;
+	int listen_fd, fd = -1, i, n, ret = 1;
+
+	if ((buf = malloc(65536)) == NULL ||
+	    (rtt = calloc(E2E_ROUNDTRIPS, sizeof(*rtt))) == NULL)
+		goto done;
+
+	/* fake ICB server on an ephemeral port */
+	if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		goto done;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof(sa);
+	if (bind(listen_fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    listen(listen_fd, 1) ||
+	    getsockname(listen_fd, (struct sockaddr *)&sa, &len)) {
+		perror("bind");
+		close(listen_fd);
+		goto done;
+	}
+	snprintf(port_icb, sizeof(port_icb), "%u", ntohs(sa.sin_port));
+	if ((server = fork()) == 0)
+		e2e_server(listen_fd);
+	close(listen_fd);
+
+	/* pick a free port for the proxy */
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		goto done;
+	}
+	sa.sin_port = 0;
+	len = sizeof(sa);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    getsockname(fd, (struct sockaddr *)&sa, &len)) {
+		perror("bind");
+		goto done;
+	}
+	close(fd);
+	snprintf(port_irc, sizeof(port_irc), "%u", ntohs(sa.sin_port));
+
+	if ((proxy = fork()) == 0) {
+		dup2(null_fd, STDOUT_FILENO);
+		dup2(null_fd, STDERR_FILENO);
+		execl(icbirc, icbirc, "-d", "-l", "127.0.0.1", "-p", port_irc,
+		    "-s", "127.0.0.1", "-P", port_icb, (char *)NULL);
+		_exit(1);
+	}
+
+	/* IRC client */
+	for (i = 0; i < 100; ++i) {
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+			perror("socket");
+			goto done;
+		}
+		if (!connect(fd, (struct sockaddr *)&sa, sizeof(sa)))
+			break;
+		close(fd);
+		fd = -1;
+		usleep(20000);
+	}
+	if (fd < 0) {
+		fprintf(stderr, "e2e: cannot connect to %s\n", icbirc);
+		goto done;
+	}
+	dprintf(fd, "NICK bench\r\nUSER bench 0 * :bench\r\n");
+	do {
+		if (e2e_readline(fd, line, sizeof(line), buf, &off))
+			goto timeout;
+	} while (strstr(line, " JOIN :#bench") == NULL);
+
+	/* throughput: server -> proxy -> client */
+	t = now();
+	dprintf(fd, "PRIVMSG #bench :go\r\n");
+	for (n = 0; n < E2E_MESSAGES; ) {
+		if (e2e_readline(fd, line, sizeof(line), buf, &off))
+			goto timeout;
+		if (strstr(line, " PRIVMSG #bench :burst ") != NULL)
+			n++;
+	}
+	*msgs = n / (now() - t);
+
+	/* latency: client -> proxy -> server -> proxy -> client */
+	for (n = 0; n < E2E_ROUNDTRIPS; ++n) {
+		char expect[64];
+
+		snprintf(expect, sizeof(expect), " PRIVMSG #bench :rtt %d", n);
+		t = now();
+		dprintf(fd, "PRIVMSG #bench :rtt %d\r\n", n);
+		do {
+			if (e2e_readline(fd, line, sizeof(line), buf, &off))
+				goto timeout;
+		} while (strstr(line, expect) == NULL);
+		rtt[n] = (now() - t) * 1e6;
+	}
+	qsort(rtt, E2E_ROUNDTRIPS, sizeof(*rtt), cmp_double);
+	*p50 = rtt[E2E_ROUNDTRIPS / 2];
+	*p99 = rtt[E2E_ROUNDTRIPS * 99 / 100];
+	ret = 0;
+	goto done;
+
+timeout:
+	fprintf(stderr, "e2e: timeout or connection closed\n");
+done:
+	if (fd >= 0)
+		close(fd);
+	if (proxy > 0) {
+		kill(proxy, SIGTERM);
+		waitpid(proxy, NULL, 0);
+	}
+	if (server > 0) {
+		kill(server, SIGTERM);
+		waitpid(server, NULL, 0);
+	}
+	free(rtt);
+	free(buf);
+	return (ret);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *baseline = NULL, *output = NULL, *icbirc = NULL;
+	const char *newbase = NULL;
+	double value[r_max], tolerance = 25.0;
+	toml_table_t *base = NULL;
+	FILE *fp;
+	int ch, i, failed = 0;
+
+	while ((ch = getopt(argc, argv, "b:o:t:w:x:")) != -1) {
+		switch (ch) {
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		case 'w':
+			newbase = optarg;
+			break;
+		case 'x':
+			icbirc = optarg;
+			break;
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (argc != optind || icbirc == NULL) {
+		usage();
+		exit(1);
+	}
+
+	toml_set_arena(1);	/* as icbirc does */
+	if (baseline != NULL) {
+		char errbuf[256];
+
+		if ((fp = fopen(baseline, "r")) == NULL) {
+			perror(baseline);
+			exit(1);
+		}
+		base = toml_parse_file(fp, errbuf, sizeof(errbuf));
+		fclose(fp);
+		if (base == NULL) {
+			fprintf(stderr, "%s: %s\n", baseline, errbuf);
+			exit(1);
+		}
+	}
+
+	if ((null_fd = open("/dev/null", O_WRONLY)) < 0) {
+		perror("/dev/null");
+		exit(1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	value[r_icb_recv] = bench_icb_recv();
+	value[r_irc_recv] = bench_irc_recv();
+	value[r_toml_parse] = bench_toml_parse();
+	value[r_toml_events] = bench_toml_events();
+	value[r_toml_file] = bench_toml_file(tf_file);
+	value[r_toml_stream] = bench_toml_file(tf_stream);
+	value[r_toml_cached] = bench_toml_file(tf_cached);
+	if (e2e_run(icbirc, &value[r_e2e_msgs], &value[r_e2e_p50],
+	    &value[r_e2e_p99])) {
+		value[r_e2e_msgs] = 0.0;
+		value[r_e2e_p50] = value[r_e2e_p99] = 1e9;
+	}
+
+	if (output != NULL && (fp = fopen(output, "w")) == NULL) {
+		perror(output);
+		exit(1);
+	}
+	if (output != NULL)
+		fprintf(fp, "{\n  \"commit\": \"%s\",\n  \"time\": %lld,\n"
+		    "  \"tolerance\": %.1f,\n  \"results\": {\n", GIT_COMMIT,
+		    (long long)time(NULL), tolerance);
+
+	for (i = 0; i < r_max; ++i) {
+		toml_datum_t d;
+		double ref = 0.0;
+		int regressed = 0;
+
+		if (base != NULL) {
+			d = toml_double_in(base, results[i].name);
+			if (d.ok)
+				ref = d.u.d;
+			else if ((d = toml_int_in(base, results[i].name)).ok)
+				ref = d.u.i;
+		}
+		if (ref > 0.0) {
+			if (results[i].higher_is_better)
+				regressed = value[i] <
+				    ref * (1.0 - tolerance / 100.0);
+			else
+				regressed = value[i] >
+				    ref * (1.0 + tolerance / 100.0);
+		}
+		failed |= regressed;
+		printf("%-16s %14.1f %-10s", results[i].name, value[i],
+		    results[i].unit);
+		if (ref > 0.0)
+			printf(" baseline %14.1f %+7.1f%%%s", ref,
+			    (value[i] - ref) * 100.0 / ref,
+			    regressed ? "  REGRESSION" : "");
+		printf("\n");
+		if (output != NULL)
+			fprintf(fp, "    \"%s\": { \"value\": %.1f, "
+			    "\"unit\": \"%s\", \"baseline\": %.1f, "
+			    "\"regressed\": %s }%s\n", results[i].name,
+			    value[i], results[i].unit, ref,
+			    regressed ? "true" : "false",
+			    i + 1 < r_max ? "," : "");
+	}
+
+	if (output != NULL) {
+		fprintf(fp, "  },\n  \"pass\": %s\n}\n",
+		    failed ? "false" : "true");
+		fclose(fp);
+	}
+	if (newbase != NULL) {
+		if ((fp = fopen(newbase, "w")) == NULL) {
+			perror(newbase);
+			exit(1);
+		}
+		fprintf(fp, "# Reference figures for `make perf-check` (see "
+		    "bench/bench.c), written\n# by `make perf-baseline` at "
+		    "commit %s.\n#\n# Throughput figures regress when they "
+		    "drop, latency figures (in\n# microseconds) when they "
+		    "rise, by more than PERF_TOLERANCE percent.\n# They are "
+		    "only meaningful on the machine that measured them.\n\n",
+		    GIT_COMMIT);
+		for (i = 0; i < r_max; ++i)
+			fprintf(fp, "%s = %.1f\t# %s\n", results[i].name,
+			    value[i], results[i].unit);
+		fclose(fp);
+	}
+	if (base != NULL)
+		toml_free(base);
+	close(null_fd);
+	return (failed);
+}
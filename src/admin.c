@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2023-2024 Laurent Cheylus <foxy@free.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <bsd/string.h>
+#include "admin.h"
+#include "flight.h"
+#include "hitters.h"
+#include "icb.h"
+#include "irc.h"
+#include "log.h"
+#include "mem.h"
+#include "prof.h"
+#include "stats.h"
+
+/*
+ * Admin control socket (-a path), a line protocol for local tools:
+ *
+ *   list                 one line per session: id nick group age
+ *                        bytes out:in, output queues irc:icb, imode
+ *   show id              full state of a session
+ *   kill id              close a session
+ *   debug id on|off      debug log level while the session lasts
+ *   trace id on|off      log every protocol event of the session
+ *   flight id            the flight recorder of a session
+ *   stats                global counters (Prometheus text format)
+ *   top                  busiest nicks and groups over the last minute
+ *   memory               memory in use by subsystem
+ *   help                 list of commands
+ *   quit                 close the admin connection
+ *
+ * Each reply ends with a line holding a single ".". Errors are a line
+ * starting with "error: ". Only one session is proxied at a time, ids
+ * are session sequence numbers so a stale id never hits a new session.
+ *
+ * Like the metrics listener, admin connections are served from the
+ * select() loops and never block: commands are handled once a full line
+ * has been read and replies are written as the socket accepts them.
+ */
+
+#define ADMIN_MAX_CLIENTS	4
+#define ADMIN_MAX_LINE		512
+#define ADMIN_MAX_OUT		(1024 * 1024)	/* unread replies, then drop */
+
+extern int terminate_client;
+
+static struct admin_client {
+	int		 fd;
+	char		 in[ADMIN_MAX_LINE];
+	size_t		 inlen;
+	struct buf	 out;
+	size_t		 outoff;
+	int		 closing;
+} admin_clients[ADMIN_MAX_CLIENTS];
+
+static int admin_listen_fd = -1;
+static int admin_log_level = -1;	/* to restore at session end */
+
+static void	 admin_close(struct admin_client *);
+static void	 admin_command(struct admin_client *, char *);
+static int	 admin_session(struct buf *, const char *);
+static void	 admin_show(struct buf *);
+
+int
+admin_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		fprintf(stderr, "admin: path too long: %s\n", path);
+		return (1);
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return (1);
+	}
+	unlink(path);
+	if (bind(fd, (const struct sockaddr *)&sun, sizeof(sun))) {
+		fprintf(stderr, "bind %s: %s\n", path, strerror(errno));
+		close(fd);
+		return (1);
+	}
+	if (chmod(path, 0600) ||
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) ||
+	    listen(fd, ADMIN_MAX_CLIENTS)) {
+		perror("listen");
+		close(fd);
+		return (1);
+	}
+	admin_listen_fd = fd;
+	mem_static(mem_input, admin_clients, sizeof(admin_clients));
+	return (0);
+}
+
+/*
+ * Add the admin listener and connections to the sets passed to
+ * select(), return the new maximum fd.
+ */
+int
+admin_fdset(fd_set *readfds, fd_set *writefds, int max_fd)
+{
+	int i;
+
+	if (admin_listen_fd < 0)
+		return (max_fd);
+	FD_SET(admin_listen_fd, readfds);
+	if (admin_listen_fd > max_fd)
+		max_fd = admin_listen_fd;
+	for (i = 0; i < ADMIN_MAX_CLIENTS; ++i) {
+		struct admin_client *c = &admin_clients[i];
+
+		if (c->fd <= 0)
+			continue;
+		if (c->out.len > c->outoff)
+			FD_SET(c->fd, writefds);
+		else
+			FD_SET(c->fd, readfds);
+		if (c->fd > max_fd)
+			max_fd = c->fd;
+	}
+	return (max_fd);
+}
+
+void
+admin_process(fd_set *readfds, fd_set *writefds)
+{
+	int i;
+
+	if (admin_listen_fd < 0)
+		return;
+	for (i = 0; i < ADMIN_MAX_CLIENTS; ++i) {
+		struct admin_client *c = &admin_clients[i];
+		ssize_t len;
+		char *nl;
+
+		if (c->fd <= 0)
+			continue;
+		if (c->out.len > c->outoff && FD_ISSET(c->fd, writefds)) {
+			len = write(c->fd, c->out.p + c->outoff,
+			    c->out.len - c->outoff);
+			if (len < 0 && errno != EINTR && errno != EAGAIN)
+				admin_close(c);
+			else if (len > 0 && (c->outoff += len) == c->out.len) {
+				c->out.len = c->outoff = 0;
+				if (c->closing)
+					admin_close(c);
+			}
+			continue;
+		}
+		if (c->out.len > c->outoff || !FD_ISSET(c->fd, readfds))
+			continue;
+		len = read(c->fd, c->in + c->inlen,
+		    sizeof(c->in) - 1 - c->inlen);
+		if (len <= 0) {
+			if (len == 0 || (errno != EINTR && errno != EAGAIN))
+				admin_close(c);
+			continue;
+		}
+		c->inlen += len;
+		c->in[c->inlen] = 0;
+		/* commands are handled in order, replies are queued */
+		while (!c->closing && (nl = strchr(c->in, '\n')) != NULL) {
+			*nl = 0;
+			if (nl > c->in && nl[-1] == '\r')
+				nl[-1] = 0;
+			admin_command(c, c->in);
+			c->inlen -= nl + 1 - c->in;
+			memmove(c->in, nl + 1, c->inlen + 1);
+		}
+		if (c->inlen == sizeof(c->in) - 1) {
+			bprintf(&c->out, "error: line too long\n.\n");
+			c->inlen = 0;
+		}
+		/* no reply yet is fine: the line may be incomplete */
+		if (c->out.failed || c->out.len > ADMIN_MAX_OUT)
+			admin_close(c);
+	}
+	if (FD_ISSET(admin_listen_fd, readfds)) {
+		int fd;
+
+		if ((fd = accept(admin_listen_fd, NULL, NULL)) < 0)
+			return;
+		for (i = 0; i < ADMIN_MAX_CLIENTS; ++i)
+			if (admin_clients[i].fd <= 0)
+				break;
+		if (i == ADMIN_MAX_CLIENTS ||
+		    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+			close(fd);
+			return;
+		}
+		memset(&admin_clients[i], 0, sizeof(admin_clients[i]));
+		admin_clients[i].fd = fd;
+	}
+}
+
+/* undo per-session settings, called when a session ends */
+void
+admin_session_end(void)
+{
+	if (admin_log_level >= 0) {
+		log_level = admin_log_level;
+		admin_log_level = -1;
+	}
+	flight_trace = 0;
+}
+
+static void
+admin_close(struct admin_client *c)
+{
+	close(c->fd);
+	mem_free(mem_output, c->out.p);
+	memset(c, 0, sizeof(*c));
+}
+
+/* check that id names the current session, or reply with an error */
+static int
+admin_session(struct buf *b, const char *id)
+{
+	if (id == NULL) {
+		bprintf(b, "error: missing session id\n");
+		return (1);
+	}
+	if (session.client_fd < 0 || strtoul(id, NULL, 10) != session.id) {
+		bprintf(b, "error: no such session: %s\n", id);
+		return (1);
+	}
+	return (0);
+}
+
+static void
+admin_show(struct buf *b)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	char setup[160];
+	int i;
+
+	bprintf(b, "id %u\n", session.id);
+	memset(&sa, 0, sizeof(sa));
+	if (!getpeername(session.client_fd, (struct sockaddr *)&sa, &len))
+		bprintf(b, "client %s:%u\n", inet_ntoa(sa.sin_addr),
+		    ntohs(sa.sin_port));
+	len = sizeof(sa);
+	if (session.server_fd >= 0 &&
+	    !getpeername(session.server_fd, (struct sockaddr *)&sa, &len))
+		bprintf(b, "server %s:%u\n", inet_ntoa(sa.sin_addr),
+		    ntohs(sa.sin_port));
+	bprintf(b, "age %lld\n", (long long)(time(NULL) - session.start));
+	bprintf(b, "nick %s\nident %s\ngroup %s\nlogged_in %d\n", irc_nick,
+	    irc_ident, irc_channel, icb_logged_in);
+	bprintf(b, "icb_server %s\nicb_host %s\nicb_protocol %s\n"
+	    "moderator %s\nimode %s\n", icb_serverid, icb_hostid,
+	    icb_protolevel, icb_moderator, icb_imode());
+	bprintf(b, "bytes icb_in %llu icb_out %llu irc_in %llu irc_out %llu\n",
+	    (unsigned long long)session.bytes[dir_icb_in],
+	    (unsigned long long)session.bytes[dir_icb_out],
+	    (unsigned long long)session.bytes[dir_irc_in],
+	    (unsigned long long)session.bytes[dir_irc_out]);
+	bprintf(b, "outq irc %ld icb %ld\n", stats_outq(session.client_fd),
+	    stats_outq(session.server_fd));
+	for (i = 0; i < peer_max; ++i)
+		if (stats.tcp[i].valid)
+			bprintf(b, "tcp %s rtt %u rttvar %u retrans %u "
+			    "unacked %u\n", i == peer_irc ? "irc" : "icb",
+			    stats.tcp[i].rtt, stats.tcp[i].rttvar,
+			    stats.tcp[i].retrans, stats.tcp[i].unacked);
+	stats_phases(setup, sizeof(setup));
+	bprintf(b, "setup %s\n", setup);
+	bprintf(b, "debug %s\ntrace %s\n", log_level >= LOG_DEBUG ? "on" :
+	    "off", flight_trace ? "on" : "off");
+}
+
+static void
+admin_command(struct admin_client *c, char *line)
+{
+	struct buf *b = &c->out;
+	char *argv[4], *p;
+	int argc = 0;
+
+	while (argc < 4 && (p = strsep(&line, " \t")) != NULL)
+		if (*p)
+			argv[argc++] = p;
+	while (argc < 4)
+		argv[argc++] = NULL;
+
+	if (argv[0] == NULL)
+		;
+	else if (!strcmp(argv[0], "help"))
+		bprintf(b, "list\nshow id\nkill id\ndebug id on|off\n"
+		    "trace id on|off\nflight id\nstats\ntop\nmemory\nquit\n");
+	else if (!strcmp(argv[0], "list")) {
+		if (session.client_fd >= 0)
+			bprintf(b, "%u %s %s %lld %llu:%llu %ld:%ld %s\n",
+			    session.id, irc_nick[0] ? irc_nick : "-",
+			    irc_channel[0] ? irc_channel : "-",
+			    (long long)(time(NULL) - session.start),
+			    (unsigned long long)session.bytes[dir_irc_in],
+			    (unsigned long long)session.bytes[dir_icb_in],
+			    stats_outq(session.client_fd),
+			    stats_outq(session.server_fd), icb_imode());
+	} else if (!strcmp(argv[0], "show")) {
+		if (!admin_session(b, argv[1]))
+			admin_show(b);
+	} else if (!strcmp(argv[0], "kill")) {
+		if (!admin_session(b, argv[1])) {
+			log_msg(LOG_NOTICE, logk_session, "session %u killed "
+			    "by admin", session.id);
+			terminate_client = 1;
+		}
+	} else if (!strcmp(argv[0], "debug") || !strcmp(argv[0], "trace")) {
+		int on;
+
+		if (argv[2] == NULL || (strcmp(argv[2], "on") &&
+		    strcmp(argv[2], "off")))
+			bprintf(b, "error: usage: %s id on|off\n", argv[0]);
+		else if (!admin_session(b, argv[1])) {
+			on = !strcmp(argv[2], "on");
+			if (argv[0][0] == 't')
+				flight_trace = on;
+			else {
+				if (admin_log_level < 0)
+					admin_log_level = log_level;
+				log_level = on ? LOG_DEBUG : admin_log_level;
+			}
+		}
+	} else if (!strcmp(argv[0], "flight")) {
+		if (!admin_session(b, argv[1]))
+			flight_write(b);
+	} else if (!strcmp(argv[0], "stats"))
+		stats_render(b);
+	else if (!strcmp(argv[0], "top"))
+		hh_write(b);
+	else if (!strcmp(argv[0], "memory"))
+		mem_write(b);
+	else if (!strcmp(argv[0], "quit"))
+		c->closing = 1;
+	else
+		bprintf(b, "error: unknown command: %s\n", argv[0]);
+	bprintf(b, ".\n");
+}
@@ -0,0 +1,12 @@
+#ifndef _ADMIN_H_
+#define _ADMIN_H_
+
+#include <sys/types.h>
+#include <sys/select.h>
+
+int	 admin_listen(const char *);
+int	 admin_fdset(fd_set *, fd_set *, int);
+void	 admin_process(fd_set *, fd_set *);
+void	 admin_session_end(void);
+
+#endif
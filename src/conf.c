@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) 2023-2024 Laurent Cheylus <foxy@free.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <bsd/string.h>
+#include "conf.h"
+#include "mem.h"
+#include "toml.h"
+
+/*
+ * The file is parsed into a TOML tree, then every known key is looked
+ * up and checked for its type and range before being copied into
+ * struct conf, and the tree is freed. Tables and keys that are not
+ * known are errors rather than being ignored: they are most likely
+ * typos, and a setting silently not applied is hard to notice.
+ *
+ * The *.toml files of a configuration directory are parsed the same
+ * way, by as many threads as there are CPUs (up to CONF_WORKERS), each
+ * taking the next file not yet parsed. They are then applied one after
+ * the other in the order of their names, so the outcome does not
+ * depend on which parse finished first. They override the main file,
+ * as with any conf.d directory, but not each other: two of them setting
+ * a key to different values is an error naming both, whatever their
+ * order, rather than one tenant's setting silently replacing another's.
+ */
+
+#define CONF_WORKERS	16
+
+enum { conf_string, conf_int };
+
+static const struct conf_key {
+	const char	*table;
+	const char	*key;
+	int		 type;
+	size_t		 off;		/* in struct conf */
+	size_t		 len;		/* of strings, with the NUL */
+	int64_t		 min, max;	/* of integers */
+} conf_keys[] = {
+	{ "server", "name", conf_string, offsetof(struct conf, server_name),
+	    sizeof(((struct conf *)0)->server_name), 0, 0 },
+	{ "server", "port", conf_int, offsetof(struct conf, server_port),
+	    0, 1, 65535 },
+	{ "server", "listen-address", conf_string,
+	    offsetof(struct conf, listen_address),
+	    sizeof(((struct conf *)0)->listen_address), 0, 0 },
+	{ "server", "listen-port", conf_int,
+	    offsetof(struct conf, listen_port), 0, 1, 65535 },
+	{ "log", "destination", conf_string,
+	    offsetof(struct conf, log_destination), CONF_PATH, 0, 0 },
+	{ "log", "level", conf_string, offsetof(struct conf, log_level),
+	    sizeof(((struct conf *)0)->log_level), 0, 0 },
+	{ "log", "rate", conf_int, offsetof(struct conf, log_rate), 0, 1,
+	    1000000 },
+	{ "log", "slow-usec", conf_int, offsetof(struct conf, log_slow_usec),
+	    0, 0, 60000000 },
+	{ "metrics", "listen", conf_string,
+	    offsetof(struct conf, metrics_listen), CONF_PATH, 0, 0 },
+	{ "admin", "socket", conf_string,
+	    offsetof(struct conf, admin_socket), CONF_PATH, 0, 0 },
+	{ "events", "socket", conf_string,
+	    offsetof(struct conf, events_socket), CONF_PATH, 0, 0 },
+	{ "events", "queue", conf_int, offsetof(struct conf, events_queue),
+	    0, 4096, 64 * 1024 * 1024 },
+	{ "stats", "file", conf_string, offsetof(struct conf, stats_file),
+	    CONF_PATH, 0, 0 },
+	{ "timeouts", "write", conf_int,
+	    offsetof(struct conf, timeout_write), 0, 0, 3600 },
+	{ NULL }
+};
+
+static const struct {
+	const char	*name;
+	int		 level;
+} conf_levels[] = {
+	{ "err", LOG_ERR }, { "warning", LOG_WARNING },
+	{ "notice", LOG_NOTICE }, { "info", LOG_INFO }, { "debug", LOG_DEBUG },
+	{ NULL }
+};
+
+/* a file of the configuration directory */
+struct conf_frag {
+	char		 path[CONF_PATH];
+	toml_table_t	*root;		/* NULL if the parse failed */
+	char		 err[256];
+};
+
+/* files shared by the threads parsing them */
+struct conf_pool {
+	struct conf_frag *frags;
+	int		 nfrags;
+	int		 next;		/* next one to parse, atomic */
+};
+
+const struct conf *conf_current;
+static struct conf *conf_retired;
+
+static int	 conf_check(const toml_table_t *, char *, size_t);
+static int	 conf_apply(const toml_table_t *, const char *,
+		    const char **, struct conf *, char *, size_t);
+static int	 conf_dir_filter(const struct dirent *);
+static int	 conf_dir_cmp(const struct dirent **, const struct dirent **);
+static void	*conf_worker(void *);
+static int	 conf_load_dir(const char *, struct conf *, char *, size_t);
+
+/* defaults, as without a configuration file */
+void
+conf_init(struct conf *c)
+{
+	memset(c, 0, sizeof(*c));
+	c->server_port = 7326;
+	c->listen_port = 6667;
+	c->log_rate = 20;
+	c->events_queue = 256 * 1024;
+}
+
+/* reject unknown tables and keys, non-zero with err set if any */
+static int
+conf_check(const toml_table_t *root, char *err, size_t errlen)
+{
+	const struct conf_key *k;
+	const char *table, *key;
+	toml_table_t *t;
+	int i, j;
+
+	for (i = 0; (table = toml_key_in(root, i)) != NULL; ++i) {
+		for (k = conf_keys; k->table != NULL; ++k)
+			if (!strcmp(k->table, table))
+				break;
+		if (k->table == NULL) {
+			snprintf(err, errlen, "unknown table [%s]", table);
+			return (1);
+		}
+		if ((t = toml_table_in(root, table)) == NULL) {
+			snprintf(err, errlen, "%s: not a table", table);
+			return (1);
+		}
+		for (j = 0; (key = toml_key_in(t, j)) != NULL; ++j) {
+			for (k = conf_keys; k->table != NULL; ++k)
+				if (!strcmp(k->table, table) &&
+				    !strcmp(k->key, key))
+					break;
+			if (k->table == NULL) {
+				snprintf(err, errlen, "unknown key %s.%s",
+				    table, key);
+				return (1);
+			}
+		}
+	}
+	return (0);
+}
+
+/*
+ * Copy the known keys of root, read from file name, into c, replacing
+ * the values set before. If from is not NULL, it has the file that set
+ * each key of conf_keys so far, NULL for none, and a key set to another
+ * value is a conflict. Returns non-zero with a message in err if a
+ * value is not valid or conflicts.
+ */
+static int
+conf_apply(const toml_table_t *root, const char *name, const char **from,
+    struct conf *c, char *err, size_t errlen)
+{
+	const struct conf_key *k;
+	toml_table_t *t;
+	toml_datum_t d;
+	toml_view_t v;
+	char *s;
+	int64_t *i;
+
+	for (k = conf_keys; k->table != NULL; ++k) {
+		if ((t = toml_table_in(root, k->table)) == NULL ||
+		    !toml_key_exists(t, k->key))
+			continue;
+		if (k->type == conf_string) {
+			v = toml_string_view_in(t, k->key);
+			if (!v.ok) {
+				snprintf(err, errlen, "%s.%s: not a string",
+				    k->table, k->key);
+				return (1);
+			}
+			if ((size_t)v.len >= k->len) {
+				snprintf(err, errlen, "%s.%s: too long",
+				    k->table, k->key);
+				return (1);
+			}
+			if (memchr(v.ptr, 0, v.len) != NULL) {
+				snprintf(err, errlen, "%s.%s: contains a NUL "
+				    "character", k->table, k->key);
+				return (1);
+			}
+			s = (char *)c + k->off;
+			if (from != NULL && from[k - conf_keys] != NULL &&
+			    (strlen(s) != (size_t)v.len ||
+			    memcmp(s, v.ptr, v.len)))
+				goto conflict;
+			memcpy(s, v.ptr, v.len);
+			s[v.len] = 0;
+		} else {
+			d = toml_int_in(t, k->key);
+			if (!d.ok) {
+				snprintf(err, errlen, "%s.%s: not an integer",
+				    k->table, k->key);
+				return (1);
+			}
+			if (d.u.i < k->min || d.u.i > k->max) {
+				snprintf(err, errlen, "%s.%s: %lld not in "
+				    "%lld..%lld", k->table, k->key,
+				    (long long)d.u.i, (long long)k->min,
+				    (long long)k->max);
+				return (1);
+			}
+			i = (int64_t *)((char *)c + k->off);
+			if (from != NULL && from[k - conf_keys] != NULL &&
+			    *i != d.u.i)
+				goto conflict;
+			*i = d.u.i;
+		}
+		if (from != NULL)
+			from[k - conf_keys] = name;
+	}
+	return (0);
+
+conflict:
+	snprintf(err, errlen, "%s.%s: set to another value in %s", k->table,
+	    k->key, from[k - conf_keys]);
+	return (1);
+}
+
+/* *.toml, hidden files excepted */
+static int
+conf_dir_filter(const struct dirent *d)
+{
+	size_t len = strlen(d->d_name);
+
+	return (d->d_name[0] != '.' && len > 5 &&
+	    !strcmp(d->d_name + len - 5, ".toml"));
+}
+
+/* byte order, whatever the locale */
+static int
+conf_dir_cmp(const struct dirent **a, const struct dirent **b)
+{
+	return (strcmp((*a)->d_name, (*b)->d_name));
+}
+
+/* parse files of the pool until there are none left */
+static void *
+conf_worker(void *arg)
+{
+	struct conf_pool *pool = arg;
+	struct conf_frag *f;
+	FILE *fp;
+	int i;
+
+	while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+	    pool->nfrags) {
+		f = &pool->frags[i];
+		if ((fp = fopen(f->path, "r")) == NULL) {
+			snprintf(f->err, sizeof(f->err), "%s", strerror(errno));
+			continue;
+		}
+		f->root = toml_parse_file(fp, f->err, sizeof(f->err));
+		fclose(fp);
+	}
+	return (NULL);
+}
+
+/*
+ * Parse the *.toml files of dir in parallel and apply them to c in the
+ * order of their names, overriding the main file. See conf_apply() for
+ * the conflicts between them.
+ */
+static int
+conf_load_dir(const char *dir, struct conf *c, char *err, size_t errlen)
+{
+	struct conf_pool pool;
+	struct conf_frag *f;
+	struct dirent **names;
+	pthread_t tid[CONF_WORKERS];
+	const char *from[sizeof(conf_keys) / sizeof(conf_keys[0])];
+	char e[256];
+	long ncpu;
+	int i, n, nthreads = 0, ret = 1;
+
+	if ((n = scandir(dir, &names, conf_dir_filter, conf_dir_cmp)) < 0) {
+		snprintf(err, errlen, "%s: %s", dir, strerror(errno));
+		return (1);
+	}
+	memset(&pool, 0, sizeof(pool));
+	if (n > 0 && (pool.frags = mem_alloc(mem_toml,
+	    n * sizeof(*pool.frags))) == NULL) {
+		snprintf(err, errlen, "%s: %s", dir, strerror(errno));
+		for (i = 0; i < n; ++i)
+			free(names[i]);
+		free(names);
+		return (1);
+	}
+	for (i = 0; i < n; ++i) {
+		f = &pool.frags[i];
+		snprintf(f->path, sizeof(f->path), "%s/%s", dir,
+		    names[i]->d_name);
+		f->root = NULL;
+		f->err[0] = 0;
+		free(names[i]);
+	}
+	free(names);
+	pool.nfrags = n;
+
+	/*
+	 * The calling thread parses too, a thread that cannot be created
+	 * only means less parallelism.
+	 */
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	while (nthreads < CONF_WORKERS && nthreads + 1 < ncpu &&
+	    nthreads + 1 < n &&
+	    pthread_create(&tid[nthreads], NULL, conf_worker, &pool) == 0)
+		nthreads++;
+	conf_worker(&pool);
+	for (i = 0; i < nthreads; ++i)
+		pthread_join(tid[i], NULL);
+
+	memset(from, 0, sizeof(from));
+	for (i = 0; i < n; ++i) {
+		f = &pool.frags[i];
+		if (f->root == NULL) {
+			snprintf(err, errlen, "%s: %s", f->path, f->err);
+			goto done;
+		}
+		if (conf_check(f->root, e, sizeof(e)) ||
+		    conf_apply(f->root, f->path, from, c, e, sizeof(e))) {
+			snprintf(err, errlen, "%s: %s", f->path, e);
+			goto done;
+		}
+	}
+	ret = 0;
+done:
+	for (i = 0; i < n; ++i)
+		toml_free(pool.frags[i].root);
+	mem_free(mem_toml, pool.frags);
+	return (ret);
+}
+
+/*
+ * Read path into c, which holds the defaults. If cache is not NULL, the
+ * precompiled image of path kept there is used when it is current, and
+ * rewritten otherwise. If dir is not NULL, its *.toml files are read
+ * as well, overriding path. Returns non-zero with a message in err if
+ * a file cannot be read or is not valid, or if two files of dir set a
+ * key to different values.
+ */
+int
+conf_load(const char *path, const char *cache, const char *dir,
+    struct conf *c, char *err, size_t errlen)
+{
+	toml_table_t *root;
+	char errbuf[256];
+	int ret = 1;
+
+	root = toml_parse_cached(path, cache, errbuf, sizeof(errbuf));
+	if (root == NULL) {
+		snprintf(err, errlen, "%s", errbuf);
+		return (1);
+	}
+	if (conf_check(root, err, errlen) ||
+	    conf_apply(root, path, NULL, c, err, errlen))
+		goto done;
+	if (dir != NULL && conf_load_dir(dir, c, err, errlen))
+		goto done;
+
+	if (!c->server_name[0]) {
+		snprintf(err, errlen, "server.name: missing");
+		goto done;
+	}
+	if (c->log_level[0] && conf_level(c) < 0) {
+		snprintf(err, errlen, "log.level: unknown level %s",
+		    c->log_level);
+		goto done;
+	}
+	ret = 0;
+done:
+	toml_free(root);
+	return (ret);
+}
+
+/* syslog priority of log.level, -1 if unset or unknown */
+int
+conf_level(const struct conf *c)
+{
+	int i;
+
+	for (i = 0; conf_levels[i].name != NULL; ++i)
+		if (!strcmp(conf_levels[i].name, c->log_level))
+			return (conf_levels[i].level);
+	return (-1);
+}
+
+/* make c, allocated with mem_alloc(mem_toml), the current snapshot */
+void
+conf_publish(struct conf *c)
+{
+	/* reloads are done at quiescent points, older ones are unused */
+	mem_free(mem_toml, conf_retired);
+	conf_retired = (struct conf *)conf_current;
+	conf_current = c;
+}
+
+void
+conf_quiesce(void)
+{
+	mem_free(mem_toml, conf_retired);
+	conf_retired = NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef _CONF_H_
+#define _CONF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONF_PATH	1024
+
+/* configuration file (-c), see config.toml; empty strings are unset */
+struct conf {
+	char		 server_name[256];	/* [server] */
+	int64_t		 server_port;
+	char		 listen_address[64];
+	int64_t		 listen_port;
+	char		 log_destination[CONF_PATH];	/* [log] */
+	char		 log_level[16];
+	int64_t		 log_rate;
+	int64_t		 log_slow_usec;
+	char		 metrics_listen[CONF_PATH];	/* [metrics] */
+	char		 admin_socket[CONF_PATH];	/* [admin] */
+	char		 events_socket[CONF_PATH];	/* [events] */
+	int64_t		 events_queue;
+	char		 stats_file[CONF_PATH];		/* [stats] */
+	int64_t		 timeout_write;	/* [timeouts], seconds, 0 = none */
+};
+
+/*
+ * The configuration in use is an immutable snapshot: a reload builds a
+ * new one and publishes it, readers only follow conf_current. The
+ * previous snapshot stays valid until conf_quiesce(), called from the
+ * top of the select() loops where nothing refers to it any more.
+ */
+extern const struct conf *conf_current;
+
+void	 conf_init(struct conf *);
+int	 conf_load(const char *, const char *, const char *, struct conf *,
+	    char *, size_t);
+int	 conf_level(const struct conf *);
+void	 conf_publish(struct conf *);
+void	 conf_quiesce(void);
+
+#endif
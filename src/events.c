@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2023-2024 Laurent Cheylus <foxy@free.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <bsd/string.h>
+#include "events.h"
+#include "irc.h"
+#include "mem.h"
+#include "stats.h"
+
+/*
+ * Each event is one line of JSON:
+ *
+ *   {"time":1700000000.123456,"session":3,"type":"open",
+ *    "group":"#g","nick":"bob","text":"hello"}
+ *
+ * with a last member that depends on the type: "text" for messages,
+ * "host" for arrivals, departures and sign-ons, "reason" for sign-offs,
+ * "to" for name changes, "topic" for topic changes and "by" for boots.
+ * Strings are passed as received from the server, with quotes,
+ * backslashes and control characters escaped.
+ *
+ * An event is formatted once and appended to the queue of every
+ * subscriber. Queues are written from the select() loops, so the
+ * events of a read(2) from the server go out in a single write(2) per
+ * subscriber. A subscriber with events_queue bytes unread misses
+ * events until it catches up, it is then sent a
+ *
+ *   {"time":1700000000.123456,"type":"dropped","count":42}
+ *
+ * line first. Nothing is read from subscribers, data they send is
+ * discarded.
+ */
+
+#define EVENTS_MAX_CLIENTS	8
+#define EVENTS_MAX_QUEUE	(256 * 1024)
+#define EVENTS_MAX_LINE		2048
+
+static struct events_client {
+	int		 fd;
+	struct buf	 out;
+	size_t		 outoff;
+	uint64_t	 dropped;	/* since the last "dropped" event */
+} events_clients[EVENTS_MAX_CLIENTS];
+
+size_t events_queue = EVENTS_MAX_QUEUE;
+
+static int events_listen_fd = -1;
+static int events_nclients;
+
+static const struct {
+	const char	*type;
+	const char	*arg;		/* name of the last member */
+} events_types[ev_max] = {
+	{ "open", "text" }, { "personal", "text" }, { "arrive", "host" },
+	{ "depart", "host" }, { "signon", "host" }, { "signoff", "reason" },
+	{ "name", "to" }, { "topic", "topic" }, { "boot", "by" }
+};
+
+static void	 events_close(struct events_client *);
+static size_t	 events_quote(char *, size_t, const char *);
+
+int
+events_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		fprintf(stderr, "events: path too long: %s\n", path);
+		return (1);
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return (1);
+	}
+	unlink(path);
+	if (bind(fd, (const struct sockaddr *)&sun, sizeof(sun))) {
+		fprintf(stderr, "bind %s: %s\n", path, strerror(errno));
+		close(fd);
+		return (1);
+	}
+	if (chmod(path, 0600) ||
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) ||
+	    listen(fd, EVENTS_MAX_CLIENTS)) {
+		perror("listen");
+		close(fd);
+		return (1);
+	}
+	events_listen_fd = fd;
+	mem_static(mem_output, events_clients, sizeof(events_clients));
+	return (0);
+}
+
+/*
+ * Add the events listener and subscribers to the sets passed to
+ * select(), return the new maximum fd.
+ */
+int
+events_fdset(fd_set *readfds, fd_set *writefds, int max_fd)
+{
+	int i;
+
+	if (events_listen_fd < 0)
+		return (max_fd);
+	FD_SET(events_listen_fd, readfds);
+	if (events_listen_fd > max_fd)
+		max_fd = events_listen_fd;
+	for (i = 0; i < EVENTS_MAX_CLIENTS; ++i) {
+		struct events_client *c = &events_clients[i];
+
+		if (c->fd <= 0)
+			continue;
+		FD_SET(c->fd, readfds);
+		if (c->out.len > c->outoff)
+			FD_SET(c->fd, writefds);
+		if (c->fd > max_fd)
+			max_fd = c->fd;
+	}
+	return (max_fd);
+}
+
+void
+events_process(fd_set *readfds, fd_set *writefds)
+{
+	char discard[512];
+	ssize_t len;
+	int i;
+
+	if (events_listen_fd < 0)
+		return;
+	for (i = 0; i < EVENTS_MAX_CLIENTS; ++i) {
+		struct events_client *c = &events_clients[i];
+
+		if (c->fd <= 0)
+			continue;
+		if (FD_ISSET(c->fd, readfds)) {
+			len = read(c->fd, discard, sizeof(discard));
+			if (len == 0 || (len < 0 && errno != EINTR &&
+			    errno != EAGAIN)) {
+				events_close(c);
+				continue;
+			}
+		}
+		if (c->out.len > c->outoff && FD_ISSET(c->fd, writefds)) {
+			len = write(c->fd, c->out.p + c->outoff,
+			    c->out.len - c->outoff);
+			if (len < 0 && errno != EINTR && errno != EAGAIN)
+				events_close(c);
+			else if (len > 0 &&
+			    (c->outoff += len) == c->out.len)
+				c->out.len = c->outoff = 0;
+		}
+	}
+	if (FD_ISSET(events_listen_fd, readfds)) {
+		int fd;
+
+		if ((fd = accept(events_listen_fd, NULL, NULL)) < 0)
+			return;
+		for (i = 0; i < EVENTS_MAX_CLIENTS; ++i)
+			if (events_clients[i].fd <= 0)
+				break;
+		if (i == EVENTS_MAX_CLIENTS ||
+		    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+			close(fd);
+			return;
+		}
+		memset(&events_clients[i], 0, sizeof(events_clients[i]));
+		events_clients[i].fd = fd;
+		events_nclients++;
+		stats.event_subscribers = events_nclients;
+	}
+}
+
+static void
+events_close(struct events_client *c)
+{
+	close(c->fd);
+	mem_free(mem_output, c->out.p);
+	memset(c, 0, sizeof(*c));
+	events_nclients--;
+	stats.event_subscribers = events_nclients;
+}
+
+/* copy s to d as the contents of a JSON string, return the length */
+static size_t
+events_quote(char *d, size_t siz, const char *s)
+{
+	size_t len = 0;
+
+	for (; *s && len + 7 < siz; ++s) {
+		unsigned char ch = *s;
+
+		if (ch == '"' || ch == '\\') {
+			d[len++] = '\\';
+			d[len++] = ch;
+		} else if (ch < 0x20)
+			len += snprintf(d + len, siz - len, "\\u%04x", ch);
+		else
+			d[len++] = ch;
+	}
+	d[len] = 0;
+	return (len);
+}
+
+/* queue an event of the given type for all subscribers */
+void
+events_add(int type, const char *nick, const char *arg)
+{
+	char line[EVENTS_MAX_LINE], group[256], who[256], text[1024];
+	struct timespec ts;
+	int i, len;
+
+	if (events_nclients == 0)
+		return;
+	stats.events++;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	events_quote(group, sizeof(group), irc_channel);
+	events_quote(who, sizeof(who), nick);
+	events_quote(text, sizeof(text), arg != NULL ? arg : "");
+	len = snprintf(line, sizeof(line), "{\"time\":%lld.%06ld,"
+	    "\"session\":%u,\"type\":\"%s\",\"group\":\"%s\","
+	    "\"nick\":\"%s\",\"%s\":\"%s\"}\n", (long long)ts.tv_sec,
+	    ts.tv_nsec / 1000, session.id, events_types[type].type, group,
+	    who, events_types[type].arg, text);
+	if (len < 0 || len >= (int)sizeof(line))
+		return;
+
+	for (i = 0; i < EVENTS_MAX_CLIENTS; ++i) {
+		struct events_client *c = &events_clients[i];
+
+		if (c->fd <= 0)
+			continue;
+		if (c->out.len - c->outoff + len + 64 > events_queue) {
+			c->dropped++;
+			stats.events_dropped++;
+			continue;
+		}
+		if (c->outoff > 0 && c->outoff >= c->out.len / 2) {
+			memmove(c->out.p, c->out.p + c->outoff,
+			    c->out.len - c->outoff);
+			c->out.len -= c->outoff;
+			c->outoff = 0;
+		}
+		if (c->dropped) {
+			bprintf(&c->out, "{\"time\":%lld.%06ld,\"type\":"
+			    "\"dropped\",\"count\":%llu}\n",
+			    (long long)ts.tv_sec, ts.tv_nsec / 1000,
+			    (unsigned long long)c->dropped);
+			c->dropped = 0;
+		}
+		bprintf(&c->out, "%s", line);
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef _EVENTS_H_
+#define _EVENTS_H_
+
+#include <sys/types.h>
+#include <sys/select.h>
+
+/*
+ * Chat event export (-e path): every decoded ICB event is sent as a
+ * JSON line to the subscribers of a UNIX socket. Subscribers only
+ * read, each has a bounded queue and events that do not fit are
+ * dropped and counted, the chat path never waits for them.
+ */
+
+enum { ev_open, ev_personal, ev_arrive, ev_depart, ev_signon, ev_signoff,
+    ev_name, ev_topic, ev_boot, ev_max };
+
+extern size_t events_queue;	/* bytes queued per subscriber */
+
+int	 events_listen(const char *);
+int	 events_fdset(fd_set *, fd_set *, int);
+void	 events_process(fd_set *, fd_set *);
+void	 events_add(int, const char *, const char *);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2023-2024 Laurent Cheylus <foxy@free.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <bsd/string.h>
+#include "flight.h"
+#include "icb.h"
+#include "irc.h"
+#include "log.h"
+#include "mem.h"
+#include "stats.h"
+
+/*
+ * Events, with the meaning of op, len and arg:
+ *
+ *   read_icb  -, bytes read from the server, client output queue
+ *   read_irc  -, bytes read from the client, server output queue
+ *   icb       ICB command byte, packet length, -
+ *   irc       index in irc_verbs, line length, -
+ *   imode     new query mode, -, previous query mode
+ *
+ * Packets and lines are recorded once processed, after the query mode
+ * changes they caused. Output queues are sampled once per read(2).
+ */
+
+static struct flight_event {
+	uint64_t	 t;		/* stats_now() */
+	long		 arg;
+	unsigned	 len;
+	unsigned char	 type;
+	unsigned char	 op;
+} flight[FLIGHT_EVENTS];
+static unsigned flight_head;		/* events recorded */
+
+static const char *flight_types[flight_max] = { "read_icb", "read_irc",
+    "icb", "irc", "imode" };
+
+int flight_trace = 0;
+
+static void	 flight_format(const struct flight_event *, char *, size_t);
+static void	 flight_log(const char *, void *);
+static void	 flight_buf(const char *, void *);
+static void	 flight_foreach(void (*)(const char *, void *), void *);
+
+void
+flight_reset(void)
+{
+	flight_head = 0;
+	mem_static(mem_session, flight, sizeof(flight));
+}
+
+void
+flight_add(int type, int op, unsigned len, long arg)
+{
+	struct flight_event *e = &flight[flight_head++ & (FLIGHT_EVENTS - 1)];
+	char line[128];
+
+	e->t = stats_now();
+	e->type = type;
+	e->op = op;
+	e->len = len;
+	e->arg = arg;
+	if (flight_trace) {
+		flight_format(e, line, sizeof(line));
+		log_msg(LOG_INFO, logk_io, "trace %s", line);
+	}
+}
+
+/* one event, without its time */
+static void
+flight_format(const struct flight_event *e, char *line, size_t size)
+{
+	char op[16];
+	int n;
+
+	switch (e->type) {
+	case flight_icb:
+		if (e->op >= 'a' && e->op <= 'z')
+			snprintf(op, sizeof(op), "'%c'", e->op);
+		else
+			snprintf(op, sizeof(op), "0x%02x", e->op);
+		break;
+	case flight_irc:
+		for (n = 0; irc_verbs[n] != NULL && n < e->op; ++n)
+			;
+		strlcpy(op, irc_verbs[n] != NULL ? irc_verbs[n] : "other",
+		    sizeof(op));
+		break;
+	case flight_imode:
+		snprintf(op, sizeof(op), "%s>%s", icb_imodes[e->arg],
+		    icb_imodes[e->op]);
+		break;
+	default:
+		op[0] = 0;
+		break;
+	}
+	if (e->type == flight_read_icb || e->type == flight_read_irc)
+		snprintf(line, size, "%-8s len %5u outq %ld",
+		    flight_types[e->type], e->len, e->arg);
+	else if (e->type == flight_imode)
+		snprintf(line, size, "%-8s %s", flight_types[e->type], op);
+	else
+		snprintf(line, size, "%-8s %-8s len %u", flight_types[e->type],
+		    op, e->len);
+}
+
+/* call out for the header and each recorded event, oldest first */
+static void
+flight_foreach(void (*out)(const char *, void *), void *arg)
+{
+	struct flight_event *e;
+	uint64_t now = stats_now();
+	unsigned i = 0;
+	char line[128];
+	int n;
+
+	if (flight_head > FLIGHT_EVENTS)
+		i = flight_head - FLIGHT_EVENTS;
+	snprintf(line, sizeof(line), "%u of %u events", flight_head - i,
+	    flight_head);
+	out(line, arg);
+	for (; i < flight_head; ++i) {
+		e = &flight[i & (FLIGHT_EVENTS - 1)];
+		/* age relative to now */
+		n = snprintf(line, sizeof(line), "%10llu us ago ",
+		    (unsigned long long)(now - e->t));
+		flight_format(e, line + n, sizeof(line) - n);
+		out(line, arg);
+	}
+}
+
+static void
+flight_log(const char *line, void *arg)
+{
+	log_msg(LOG_INFO, logk_dump, "flight recorder (%s): %s",
+	    (const char *)arg, line);
+}
+
+static void
+flight_buf(const char *line, void *arg)
+{
+	bprintf(arg, "%s\n", line);
+}
+
+/* log the recorded events, reason tells what triggered the dump */
+void
+flight_dump(const char *reason)
+{
+	flight_foreach(flight_log, (void *)reason);
+}
+
+void
+flight_write(struct buf *b)
+{
+	flight_foreach(flight_buf, b);
+}
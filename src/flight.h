@@ -0,0 +1,28 @@
+#ifndef _FLIGHT_H_
+#define _FLIGHT_H_
+
+#include <stdint.h>
+
+/*
+ * Flight recorder: the last FLIGHT_EVENTS protocol events of the
+ * current session, dumped to the log on SIGUSR1 and when a session
+ * ends abnormally, or on request of the admin socket. Recording an
+ * event is a few stores, no syscall. With flight_trace set, each event
+ * is also logged as it is recorded.
+ */
+
+#define FLIGHT_EVENTS	128	/* power of two */
+
+enum { flight_read_icb, flight_read_irc, flight_icb, flight_irc,
+    flight_imode, flight_max };
+
+struct buf;
+
+extern int flight_trace;
+
+void	 flight_reset(void);
+void	 flight_add(int, int, unsigned, long);
+void	 flight_dump(const char *);
+void	 flight_write(struct buf *);
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2023-2024 Laurent Cheylus <foxy@free.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <bsd/string.h>
+#include "hitters.h"
+#include "mem.h"
+#include "stats.h"
+
+/*
+ * Each dimension has a count-min sketch per sub-window of HH_SLOT_SECS
+ * seconds, plus their sum which gives the estimate of a key over the
+ * window. When time moves on, the oldest sub-window is subtracted from
+ * the sum and cleared. Estimates never undercount and overcount
+ * by at most 2/HH_WIDTH of the messages in the window with probability
+ * 1 - 2^-HH_DEPTH.
+ *
+ * Next to the sketches, the HH_TOP keys with the largest estimates are
+ * kept in a small array: a key that gets a message replaces the
+ * smallest entry when its estimate is larger. With HH_TOP entries a
+ * linear scan is cheaper than maintaining a heap.
+ */
+
+#define HH_DEPTH	4
+#define HH_WIDTH	1024	/* power of two */
+#define HH_KEY		32	/* longer keys are truncated */
+
+const char *hh_names[hh_max] = { "nick", "group" };
+
+static struct hh {
+	uint32_t	 sketch[HH_SLOTS][HH_DEPTH][HH_WIDTH];
+	uint32_t	 total[HH_DEPTH][HH_WIDTH];	/* sum of the slots */
+	struct {
+		char		 key[HH_KEY];
+		unsigned	 count;
+	} top[HH_TOP];
+} hh[hh_max];
+static time_t hh_epoch;		/* sub-window of the last update */
+
+static void	 hh_advance(void);
+static uint32_t	 hh_estimate(struct hh *, const uint64_t *);
+static void	 hh_hash(const char *, uint64_t *);
+
+/* FNV-1a, two seeds for double hashing over the rows */
+static void
+hh_hash(const char *key, uint64_t *h)
+{
+	uint64_t a = 0xcbf29ce484222325ULL, b = 0x84222325cbf29ce4ULL;
+
+	for (; *key; ++key) {
+		a = (a ^ (unsigned char)*key) * 0x100000001b3ULL;
+		b = (b ^ (unsigned char)*key) * 0x100000001b3ULL;
+	}
+	h[0] = a;
+	h[1] = b | 1;
+}
+
+static uint32_t
+hh_estimate(struct hh *d, const uint64_t *h)
+{
+	uint32_t est = UINT32_MAX, n;
+	int row;
+
+	for (row = 0; row < HH_DEPTH; ++row) {
+		n = d->total[row][(h[0] + row * h[1]) & (HH_WIDTH - 1)];
+		if (n < est)
+			est = n;
+	}
+	return (est);
+}
+
+/* clear the sub-windows that went out of the window, refresh the top */
+static void
+hh_advance(void)
+{
+	time_t epoch = time(NULL) / HH_SLOT_SECS, e;
+	uint64_t h[2];
+	int dim, i, row, col;
+
+	if (epoch == hh_epoch)
+		return;
+	mem_static(mem_stats, hh, sizeof(hh));
+	for (dim = 0; dim < hh_max; ++dim) {
+		struct hh *d = &hh[dim];
+
+		for (e = hh_epoch + 1; e <= epoch &&
+		    e <= hh_epoch + HH_SLOTS; ++e) {
+			for (row = 0; row < HH_DEPTH; ++row)
+				for (col = 0; col < HH_WIDTH; ++col)
+					d->total[row][col] -=
+					    d->sketch[e % HH_SLOTS][row][col];
+			memset(d->sketch[e % HH_SLOTS], 0,
+			    sizeof(d->sketch[0]));
+		}
+		for (i = 0; i < HH_TOP; ++i) {
+			if (!d->top[i].key[0])
+				continue;
+			hh_hash(d->top[i].key, h);
+			if ((d->top[i].count = hh_estimate(d, h)) == 0)
+				d->top[i].key[0] = 0;
+		}
+	}
+	hh_epoch = epoch;
+}
+
+/* count one message for key in dimension dim */
+void
+hh_add(int dim, const char *key)
+{
+	struct hh *d = &hh[dim];
+	char k[HH_KEY];
+	uint64_t h[2];
+	uint32_t est;
+	int row, i, min = 0;
+
+	if (key == NULL || !*key)
+		return;
+	hh_advance();
+	strlcpy(k, key, sizeof(k));
+	hh_hash(k, h);
+	for (row = 0; row < HH_DEPTH; ++row) {
+		unsigned col = (h[0] + row * h[1]) & (HH_WIDTH - 1);
+
+		d->sketch[hh_epoch % HH_SLOTS][row][col]++;
+		d->total[row][col]++;
+	}
+	est = hh_estimate(d, h);
+
+	for (i = 0; i < HH_TOP; ++i) {
+		if (d->top[i].key[0] && !strcmp(d->top[i].key, k)) {
+			d->top[i].count = est;
+			return;
+		}
+		if (d->top[i].count < d->top[min].count)
+			min = i;
+	}
+	if (est > d->top[min].count || !d->top[min].key[0]) {
+		strlcpy(d->top[min].key, k, sizeof(d->top[min].key));
+		d->top[min].count = est;
+	}
+}
+
+/*
+ * Fill keys and counts with up to max entries of dimension dim, largest
+ * first, return the number of entries.
+ */
+int
+hh_top(int dim, const char **keys, unsigned *counts, int max)
+{
+	struct hh *d = &hh[dim];
+	const char *k[HH_TOP];
+	unsigned c[HH_TOP];
+	int n = 0, i, j;
+
+	hh_advance();
+	for (i = 0; i < HH_TOP; ++i) {
+		if (!d->top[i].key[0])
+			continue;
+		for (j = n++; j > 0 && c[j - 1] < d->top[i].count; --j) {
+			k[j] = k[j - 1];
+			c[j] = c[j - 1];
+		}
+		k[j] = d->top[i].key;
+		c[j] = d->top[i].count;
+	}
+	if (n > max)
+		n = max;
+	for (i = 0; i < n; ++i) {
+		keys[i] = k[i];
+		counts[i] = c[i];
+	}
+	return (n);
+}
+
+/* admin socket report */
+void
+hh_write(struct buf *b)
+{
+	const char *keys[HH_TOP];
+	unsigned counts[HH_TOP];
+	int dim, i, n;
+
+	for (dim = 0; dim < hh_max; ++dim) {
+		n = hh_top(dim, keys, counts, HH_TOP);
+		bprintf(b, "%s (messages in the last %d seconds)\n",
+		    hh_names[dim], HH_SLOTS * HH_SLOT_SECS);
+		for (i = 0; i < n; ++i)
+			bprintf(b, "%3d %8u %s\n", i + 1, counts[i], keys[i]);
+	}
+}
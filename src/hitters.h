@@ -0,0 +1,24 @@
+#ifndef _HITTERS_H_
+#define _HITTERS_H_
+
+/*
+ * Heavy hitters: approximate message counts per nick and per group
+ * over a sliding window, with a small table of the top ones. Memory
+ * use is fixed whatever the number of distinct keys.
+ */
+
+#define HH_TOP		10	/* keys kept per dimension */
+#define HH_SLOTS	6	/* sub-windows in the sliding window */
+#define HH_SLOT_SECS	10	/* seconds per sub-window */
+
+enum { hh_nick, hh_group, hh_max };
+
+struct buf;
+
+void	 hh_add(int, const char *);
+int	 hh_top(int, const char **, unsigned *, int);
+void	 hh_write(struct buf *);
+
+extern const char *hh_names[];
+
+#endif
@@ -33,8 +33,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <bsd/string.h>
+#include "events.h"
+#include "flight.h"
+#include "hitters.h"
 #include "icb.h"
 #include "irc.h"
+#include "log.h"
+#include "mem.h"
+#include "probes.h"
+#include "prof.h"
+#include "stats.h"
 
 extern int	 sync_write(int, const char *, int);
 
@@ -44,20 +52,27 @@ static void		 icb_ico(int, const char *);
 static void		 icb_iwl(int, const char *, const char *, long,
 			    long, const char *, const char *);
 static void		 icb_send_hw(int, const char *);
+static void		 icb_set_imode(int);
+static int		 icb_status_index(const unsigned char *, unsigned);
 
 extern int terminate_client;
 int icb_logged_in = 0;
 
-static char icb_protolevel[256];
-static char icb_hostid[256];
-static char icb_serverid[256];
-static char icb_moderator[256];
+char icb_protolevel[256];
+char icb_hostid[256];
+char icb_serverid[256];
+char icb_moderator[256];
 enum { imode_none, imode_list, imode_names, imode_whois, imode_who };
 static int imode = imode_none;
+const char *icb_imodes[] = { "none", "list", "names", "whois", "who" };
+/* status message types told apart in accounting, others are "other" */
+const char *icb_status_types[] = { "Status", "Arrive", "Sign-on", "Depart",
+    "Sign-off", "Name", "Topic", "Pass", "Boot", NULL };
 static char icurgroup[256];
 static char igroup[256];
 static char inick[256];
 static char ihostmask[256];
+static unsigned char packet[256];	/* being reassembled, see icb_recv() */
 static unsigned off;
 
 /*
@@ -129,38 +144,86 @@ icb_init(void)
 	memset(icb_hostid, 0, sizeof(icb_hostid));
 	memset(icb_serverid, 0, sizeof(icb_serverid));
 	memset(icb_moderator, 0, sizeof(icb_moderator));
-	imode = imode_none;
+	icb_set_imode(imode_none);
 	memset(icurgroup, 0, sizeof(icurgroup));
 	memset(igroup, 0, sizeof(igroup));
 	memset(inick, 0, sizeof(inick));
 	memset(ihostmask, 0, sizeof(ihostmask));
 	off = 0;
+
+	mem_static(mem_session, icb_protolevel, sizeof(icb_protolevel));
+	mem_static(mem_session, icb_hostid, sizeof(icb_hostid));
+	mem_static(mem_session, icb_serverid, sizeof(icb_serverid));
+	mem_static(mem_session, icb_moderator, sizeof(icb_moderator));
+	mem_static(mem_query, icurgroup, sizeof(icurgroup));
+	mem_static(mem_query, igroup, sizeof(igroup));
+	mem_static(mem_query, inick, sizeof(inick));
+	mem_static(mem_query, ihostmask, sizeof(ihostmask));
+	mem_static(mem_input, packet, sizeof(packet));
 }
 
 void
 icb_recv(const char *buf, unsigned len, int fd, int server_fd)
 {
-	static unsigned char cmd[256];
+	unsigned char *cmd = packet;
 
 	while (len > 0) {
 		if (off == 0) {
 			cmd[off++] = *buf++;
-			/* 0 < cmd[0] <= 255 */
+			/* 0 <= cmd[0] <= 255 */
 			len--;
 		}
-		/* off > 0, 0 < cmd[0] <= 255 */
+		/* off > 0, 0 <= cmd[0] <= 255 */
 		while (len > 0 && (off - 1) < cmd[0]) {
 			cmd[off++] = *buf++;
 			len--;
 		}
 		/* len == 0 || (off - 1) == cmd[0] */
 		if ((off - 1) == cmd[0]) {
+			struct prof_sample ps = { 0 };
+
+			/*
+			 * An empty packet has no command, cmd[1] is left
+			 * from the previous one: nothing to account.
+			 */
+			if (cmd[0] == 0) {
+				off = 0;
+				continue;
+			}
+			/* 0 < cmd[0], off >= 2 */
+			PROBE2(icb_packet, cmd[1], cmd[0]);
+			stats.packets[dir_icb_in]++;
+			stats.icb_cmd[cmd[1]]++;
+			trace_begin(fwd_icb_to_irc);
+			PROF_BEGIN(&ps);
 			icb_cmd(cmd + 1, off - 1 /* <= 255 */, fd, server_fd);
+			PROF_END(&ps, prof_icb, cmd[1]);
+			trace_end(cmd[1]);
+			flight_add(flight_icb, cmd[1], cmd[0], 0);
+			if (ps.active && cmd[1] == 'd')
+				prof_end(&ps, prof_status,
+				    icb_status_index(cmd + 2, off - 2));
 			off = 0;
 		}
 	}
 }
 
+/* index of the first argument of a status message in icb_status_types */
+static int
+icb_status_index(const unsigned char *arg, unsigned len)
+{
+	unsigned n;
+	int i;
+
+	for (n = 0; n < len && arg[n] != '\001'; ++n)
+		;
+	for (i = 0; icb_status_types[i] != NULL; ++i)
+		if (strlen(icb_status_types[i]) == n &&
+		    !memcmp(arg, icb_status_types[i], n))
+			break;
+	return (i);
+}
+
 static unsigned char
 icb_args(const unsigned char *data, unsigned char len, char args[255][255])
 {
@@ -203,6 +266,7 @@ icb_cmd(const unsigned char *cmd, unsigned char len, int fd, int server_fd)
 	/* 0 <= i <= 255 */
 	switch (cmd[0]) {
 	case 'a':	/* Login OK */
+		stats_phase(phase_login_ok);
 		irc_send_code(fd, icb_hostid, irc_nick, "001",
 		    "Welcome to icbirc %s", irc_nick);
 		irc_send_code(fd, icb_hostid, irc_nick, "002",
@@ -217,9 +281,13 @@ icb_cmd(const unsigned char *cmd, unsigned char len, int fd, int server_fd)
 		    "ICB server: %s", icb_serverid);
 		irc_send_code(fd, icb_hostid, irc_nick, "376",
 		    "End of MOTD");
+		stats_phase(phase_welcome);
 		icb_logged_in = 1;
 		break;
 	case 'b':	/* Open Message */
+		hh_add(hh_nick, args[0]);
+		hh_add(hh_group, irc_channel);
+		events_add(ev_open, args[0], args[1]);
 		if (!in_irc_channel) {
 			irc_send_join(fd, irc_nick, irc_channel);
 			icb_send_names(server_fd, irc_channel);
@@ -227,9 +295,12 @@ icb_cmd(const unsigned char *cmd, unsigned char len, int fd, int server_fd)
 		irc_send_msg(fd, args[0], irc_channel, args[1]);
 		break;
 	case 'c':	/* Personal Message */
+		hh_add(hh_nick, args[0]);
+		events_add(ev_personal, args[0], args[1]);
 		irc_send_msg(fd, args[0], irc_nick, args[1]);
 		break;
 	case 'd':	/* Status Message */
+		hh_add(hh_group, irc_channel);
 		if (!strcmp(args[0], "Status") && !strncmp(args[1],
 		    "You are now in group ", 21)) {
 			if (irc_channel[0])
@@ -246,6 +317,8 @@ icb_cmd(const unsigned char *cmd, unsigned char len, int fd, int server_fd)
 
 			scan(&a, nick, sizeof(nick), " ", " ");
 			scan(&a, host, sizeof(host), " (", ")");
+			events_add(args[0][0] == 'A' ? ev_arrive : ev_signon,
+			    nick, host);
 			snprintf(s, sizeof(s), "%s!%s", nick, host);
 			irc_send_join(fd, s, irc_channel);
 		} else if (!strcmp(args[0], "Depart")) {
@@ -253,6 +326,7 @@ icb_cmd(const unsigned char *cmd, unsigned char len, int fd, int server_fd)
 
 			scan(&a, nick, sizeof(nick), " ", " ");
 			scan(&a, host, sizeof(host), " (", ")");
+			events_add(ev_depart, nick, host);
 			snprintf(s, sizeof(s), "%s!%s", nick, host);
 			irc_send_part(fd, s, irc_channel);
 		} else if (!strcmp(args[0], "Sign-off")) {
@@ -264,6 +338,7 @@ icb_cmd(const unsigned char *cmd, unsigned char len, int fd, int server_fd)
 			if (strlen(reason) > 0 &&
 			    reason[strlen(reason) - 1] == '.')
 				reason[strlen(reason) - 1] = 0;
+			events_add(ev_signoff, nick, reason);
 			snprintf(s, sizeof(s), ":%s!%s QUIT :%s\r\n",
 			    nick, host, reason);
 			sync_write(fd, s, strlen(s));
@@ -275,6 +350,7 @@ icb_cmd(const unsigned char *cmd, unsigned char len, int fd, int server_fd)
 				return;
 			a += 21;
 			scan(&a, new_nick, sizeof(new_nick), " ", " ");
+			events_add(ev_name, old_nick, new_nick);
 			snprintf(s, sizeof(s), ":%s NICK :%s\r\n",
 			    old_nick, new_nick);
 			sync_write(fd, s, strlen(s));
@@ -289,6 +365,7 @@ icb_cmd(const unsigned char *cmd, unsigned char len, int fd, int server_fd)
 				return;
 			a += 23;
 			scan(&a, topic, sizeof(topic), "", "\"");
+			events_add(ev_topic, nick, topic);
 			snprintf(s, sizeof(s), ":%s TOPIC %s :%s\r\n",
 			    nick, irc_channel, topic);
 			sync_write(fd, s, strlen(s));
@@ -316,6 +393,7 @@ icb_cmd(const unsigned char *cmd, unsigned char len, int fd, int server_fd)
 			scan(&a, nick, sizeof(nick), " ", " ");
 			if (strcmp((const char *)a, " was booted."))
 				return;
+			events_add(ev_boot, nick, icb_moderator);
 			snprintf(s, sizeof(s), ":%s KICK %s %s :booted\r\n",
 			    icb_moderator, irc_channel, nick);
 			sync_write(fd, s, strlen(s));
@@ -332,16 +410,26 @@ icb_cmd(const unsigned char *cmd, unsigned char len, int fd, int server_fd)
 		break;
 	case 'g':	/* Exit */
 		irc_send_notice(fd, "ICB Exit");
-		printf("server Exit\n");
+		log_msg(LOG_INFO, logk_server, "server Exit");
 		terminate_client = 1;
 		break;
 	case 'i':	/* Command Output */
 		if (!strcmp(args[0], "co")) {
-			for (j = 1; j < i; ++j)
+			for (j = 1; j < i; ++j) {
+				struct prof_sample ps = { 0 };
+				int mode = imode;
+
+				PROF_BEGIN(&ps);
 				icb_ico(fd, args[j]);
+				PROF_END(&ps, prof_ico, mode);
+			}
 		} else if (!strcmp(args[0], "wl")) {
+			struct prof_sample ps = { 0 };
+
+			PROF_BEGIN(&ps);
 			icb_iwl(fd, args[1], args[2], atol(args[3]),
 			    atol(args[5]), args[6], args[7]);
+			PROF_END(&ps, prof_iwl, imode);
 		} else if (!strcmp(args[0], "wh")) {
 			/* display whois header, deprecated */
 		} else
@@ -349,6 +437,7 @@ icb_cmd(const unsigned char *cmd, unsigned char len, int fd, int server_fd)
 			    args[0], i - 1);
 		break;
 	case 'j':	/* Protocol */
+		stats_phase(phase_protocol);
 		strlcpy(icb_protolevel, args[0], sizeof(icb_protolevel));
 		strlcpy(icb_hostid, args[1], sizeof(icb_hostid));
 		strlcpy(icb_serverid, args[2], sizeof(icb_serverid));
@@ -463,6 +552,7 @@ icb_ico(int fd, const char *arg)
 			sync_write(fd, s, strlen(s));
 		}
 	} else if (!strncmp(arg, "Total: ", 7)) {
+		PROBE1(query_end, imode);
 		if (imode == imode_list) {
 			snprintf(s, sizeof(s), ":%s 323 %s :End of /LIST\r\n",
 			    icb_hostid, irc_nick);
@@ -478,7 +568,7 @@ icb_ico(int fd, const char *arg)
 			    icb_hostid, irc_nick, ihostmask);
 			sync_write(fd, s, strlen(s));
 		}
-		imode = imode_none;
+		icb_set_imode(imode_none);
 	} else if (strcmp(arg, " "))
 		irc_send_notice(fd, "*** Unknown ico: %s", arg);
 }
@@ -509,6 +599,7 @@ icb_send_login(int fd, const char *nick, const char *ident, const char *group)
 	cmd[off++] = '\001';
 	cmd[0] = off - 1;
 	sync_write(fd, cmd, off);
+	stats_phase(phase_login);
 }
 
 void
@@ -584,15 +675,31 @@ icb_send_hw(int fd, const char *arg)
 		cmd[off++] = *arg++;
 	cmd[off++] = 0;
 	cmd[0] = off - 1;
+	PROBE1(query_start, imode);
 	sync_write(fd, cmd, off);
 }
 
+/* current query mode, for the admin socket */
+const char *
+icb_imode(void)
+{
+	return (icb_imodes[imode]);
+}
+
+static void
+icb_set_imode(int mode)
+{
+	if (mode != imode)
+		flight_add(flight_imode, mode, 0, imode);
+	imode = mode;
+}
+
 void
 icb_send_list(int fd)
 {
 	if (imode != imode_none)
 		return;
-	imode = imode_list;
+	icb_set_imode(imode_list);
 	icb_send_hw(fd, "-g");
 }
 
@@ -601,7 +708,7 @@ icb_send_names(int fd, const char *group)
 {
 	if (imode != imode_none)
 		return;
-	imode = imode_names;
+	icb_set_imode(imode_names);
 	strlcpy(igroup, group, sizeof(igroup));
 	icb_send_hw(fd, "");
 }
@@ -611,7 +718,7 @@ icb_send_whois(int fd, const char *nick)
 {
 	if (imode != imode_none)
 		return;
-	imode = imode_whois;
+	icb_set_imode(imode_whois);
 	strlcpy(inick, nick, sizeof(inick));
 	icb_send_hw(fd, "");
 }
@@ -621,7 +728,7 @@ icb_send_who(int fd, const char *hostmask)
 {
 	if (imode != imode_none)
 		return;
-	imode = imode_who;
+	icb_set_imode(imode_who);
 	strlcpy(ihostmask, hostmask, sizeof(ihostmask));
 	icb_send_hw(fd, "");
 }
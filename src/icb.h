@@ -17,7 +17,14 @@ void	 icb_send_boot(int, const char *);
 void	 icb_send_name(int, const char *);
 void	 icb_send_raw(int, const char *);
 void	 icb_send_noop(int);
+const char *icb_imode(void);
 
 extern int icb_logged_in;
+extern char icb_protolevel[256];
+extern char icb_hostid[256];
+extern char icb_serverid[256];
+extern char icb_moderator[256];
+extern const char *icb_status_types[];
+extern const char *icb_imodes[];
 
 #endif
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2023-2024 Laurent Cheylus <foxy@free.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * icbirc-top: live view of the statistics file written by icbirc -S.
+ * The file is mapped read-only, icbirc is not involved in any way.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "shm.h"
+
+static void	 usage(void);
+static void	 read_block(const volatile void *, void *, size_t);
+static void	 show(const struct shm_file *, struct shm_global *, int);
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-b] [-n count] [-w wait] statsfile\n",
+	    __progname);
+	exit(1);
+}
+
+/* consistent copy of a block starting with its sequence counter */
+static void
+read_block(const volatile void *src, void *dst, size_t len)
+{
+	const volatile uint32_t *seq = src;
+	uint32_t s1, s2;
+
+	do {
+		while ((s1 = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		memcpy(dst, (const void *)src, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(seq, __ATOMIC_RELAXED);
+	} while (s1 != s2);
+}
+
+static void
+show(const struct shm_file *f, struct shm_global *prev, int wait)
+{
+	struct shm_global g;
+	struct shm_slot s;
+	time_t now = time(NULL);
+	char ts[32];
+	int i;
+
+	read_block(&f->global, &g, sizeof(g));
+	strftime(ts, sizeof(ts), "%H:%M:%S", localtime(&now));
+	printf("icbirc pid %lld  %s  up %llds  updated %llds ago\n",
+	    (long long)f->header.pid, ts,
+	    (long long)(now - f->header.started),
+	    (long long)(now - g.updated));
+	printf("sessions %llu  accepted %llu  rejected %llu\n",
+	    (unsigned long long)g.sessions_active,
+	    (unsigned long long)g.conn_accepted,
+	    (unsigned long long)g.conn_rejected);
+	printf("%-8s %14s %14s %10s %10s\n", "", "bytes", "packets",
+	    "bytes/s", "pkts/s");
+	for (i = 0; i < 4; ++i) {
+		static const char *dirs[4] = { "icb_in", "icb_out", "irc_in",
+		    "irc_out" };
+
+		printf("%-8s %14llu %14llu %10llu %10llu\n", dirs[i],
+		    (unsigned long long)g.bytes[i],
+		    (unsigned long long)g.packets[i],
+		    (unsigned long long)(prev->updated ?
+		    (g.bytes[i] - prev->bytes[i]) / wait : 0),
+		    (unsigned long long)(prev->updated ?
+		    (g.packets[i] - prev->packets[i]) / wait : 0));
+	}
+	*prev = g;
+
+	printf("\n%6s %-3s %-16s %-16s %8s %6s %10s %10s %8s %8s\n", "ID", "",
+	    "NICK", "GROUP", "AGE", "IDLE", "IRC_IN", "ICB_IN", "IRC_PKT",
+	    "ICB_PKT");
+	for (i = 0; i < SHM_SLOTS; ++i) {
+		read_block(&f->slot[i], &s, sizeof(s));
+		if (s.id == 0)
+			continue;
+		s.nick[sizeof(s.nick) - 1] = s.group[sizeof(s.group) - 1] = 0;
+		printf("%6u %-3s %-16s %-16s %8lld %6lld %10llu %10llu %8llu "
+		    "%8llu\n", s.id, s.active ? "*" : "", s.nick[0] ? s.nick :
+		    "-", s.group[0] ? s.group : "-",
+		    (long long)(now - s.started),
+		    (long long)(now - s.last_read),
+		    (unsigned long long)s.bytes[2],
+		    (unsigned long long)s.bytes[0],
+		    (unsigned long long)s.packets[2],
+		    (unsigned long long)s.packets[0]);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct shm_global prev;
+	struct shm_file *f;
+	struct stat st;
+	int batch = 0, count = -1, wait = 2;
+	int ch, fd;
+
+	while ((ch = getopt(argc, argv, "bn:w:")) != -1) {
+		switch (ch) {
+		case 'b':
+			batch = 1;
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'w':
+			if ((wait = atoi(optarg)) <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+
+	if ((fd = open(argv[0], O_RDONLY)) < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		return (1);
+	}
+	if (st.st_size < (off_t)sizeof(*f)) {
+		fprintf(stderr, "%s: not an icbirc statistics file\n",
+		    argv[0]);
+		return (1);
+	}
+	f = mmap(NULL, sizeof(*f), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (f == MAP_FAILED) {
+		perror("mmap");
+		return (1);
+	}
+	if (f->header.magic != SHM_MAGIC || f->header.version != SHM_VERSION ||
+	    f->header.size != sizeof(*f)) {
+		fprintf(stderr, "%s: not an icbirc statistics file of version "
+		    "%u\n", argv[0], SHM_VERSION);
+		return (1);
+	}
+
+	memset(&prev, 0, sizeof(prev));
+	while (count < 0 || count-- > 0) {
+		if (!batch)
+			printf("\033[H\033[J");
+		else if (prev.updated)
+			printf("\n");
+		show(f, &prev, wait);
+		fflush(stdout);
+		if (count != 0)
+			sleep(wait);
+	}
+	return (0);
+}
@@ -45,8 +45,19 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include "admin.h"
+#include "conf.h"
+#include "events.h"
+#include "flight.h"
 #include "icb.h"
 #include "irc.h"
+#include "log.h"
+#include "mem.h"
+#include "probes.h"
+#include "prof.h"
+#include "shm.h"
+#include "stats.h"
+#include "toml.h"
 
 #define VERSION "2.2"
 
@@ -58,17 +69,34 @@ int		sync_write(int, const char *, int);
 static void	usage(void);
 static void	options(void);
 static void	handle_client(int);
+static void	sighandler(int);
+static void	handle_signals(void);
+static int	resolve(const char *, unsigned, struct sockaddr_in *);
+static void	apply(const struct conf *);
+static void	reload(void);
 
 int terminate_client;
 static struct sockaddr_in sa_connect;
+static unsigned write_timeout = 0;	/* seconds, 0 = wait forever */
+static int stalled_fd = -1;		/* write timed out */
+static const char *conf_file = NULL;	/* read again on SIGHUP */
+static const char *conf_cache = NULL;	/* precompiled image of conf_file */
+static const char *conf_dir = NULL;	/* *.toml read after conf_file */
+static int debug = 0;
+static int slow_option = 0;		/* -t given */
+static volatile sig_atomic_t got_sighup = 0;
+static volatile sig_atomic_t got_sigusr1 = 0;
+static volatile sig_atomic_t got_sigusr2 = 0;
+static int sig_pipe[2] = { -1, -1 };	/* wakes up select() on a signal */
 
 static void
 usage(void)
 {
 	extern char *__progname;
 
-	fprintf(stderr, "usage: %s [-h] [-v] [-d] -c conffile | [-l address] [-p port] "
-	    "-s server [-P port]\n", __progname);
+	fprintf(stderr, "usage: %s [-h] [-v] [-d] [-L logfile] [-m metrics] "
+	    "[-a admin] [-e events] [-S statsfile] [-t usec] [-C cache] [-D confdir] -c conffile | [-l address] [-p port] -s server [-P port]\n",
+	    __progname);
 }
 
 static void
@@ -80,8 +108,16 @@ options(void)
 	printf("options:\n");
 	printf("  -h\t\t\tShow this help message and exit\n");
 	printf("  -v\t\t\tShow version\n");
-	printf("  -d\t\t\tDo not daemonize (detach from controlling terminal)\n\t\t\tand produce debugging output on stdout/stderr\n");
+	printf("  -d\t\t\tDo not daemonize (detach from controlling terminal)\n\t\t\tand produce debugging output on stderr\n");
+	printf("  -L logfile\t\tLog to logfile instead of syslog\n");
 	printf("  -c conffile\t\tConfiguration file (TOML format)\n");
+	printf("  -C cache\t\tKeep a precompiled image of conffile in file cache\n");
+	printf("  -D confdir\t\tRead the *.toml files of confdir after conffile\n");
+	printf("  -m metrics\t\tServe metrics on [address:]port or UNIX socket path\n");
+	printf("  -a admin\t\tServe the admin control protocol on UNIX socket path admin\n");
+	printf("  -e events\t\tExport chat events as JSON lines on UNIX socket path events\n");
+	printf("  -S statsfile\t\tPublish counters in shared memory file statsfile (see icbirc-top)\n");
+	printf("  -t usec\t\tLog messages taking more than usec microseconds to forward\n");
 	printf("  -l listen-address\tBind to the specified address when listening for client connections.\n\t\t\tIf not specified, connections to any address are accepted\n");
 	printf("  -p listen-port\tBind to the specified port when listening for client connections.\n\t\t\tDefaults to 6667 when not specified\n");
 	printf("  -s server-name\tHostname or numerical address of the ICB server to connect to\n");
@@ -91,17 +127,20 @@ options(void)
 int
 main(int argc, char *argv[])
 {
-	int debug = 0;
 	const char *addr_listen = NULL, *addr_connect = NULL;
-	const char *conf_file = NULL;
+	const char *metrics = NULL, *log_file = NULL;
+	const char *admin = NULL, *events = NULL, *shm_file = NULL;
 	unsigned port_listen = 6667, port_connect = 7326;
+	struct conf *conf;
+	char err[256];
 	int ch;
+	int net_option = 0;		/* -l, -p or -P given */
 	int listen_fd = -1;
 	struct sockaddr_in sa;
 	socklen_t len;
 	int val;
 
-	while ((ch = getopt(argc, argv, "hvdc:l:p:s:P:")) != -1) {
+	while ((ch = getopt(argc, argv, "hvdc:C:D:L:m:a:e:S:t:l:p:s:P:")) != -1) {
 		switch (ch) {
 		case 'h':
 			options();
@@ -117,17 +156,45 @@ main(int argc, char *argv[])
 		case 'c':
 			conf_file = optarg;
 			break;
+		case 'C':
+			conf_cache = optarg;
+			break;
+		case 'D':
+			conf_dir = optarg;
+			break;
+		case 'L':
+			log_file = optarg;
+			break;
+		case 'm':
+			metrics = optarg;
+			break;
+		case 'a':
+			admin = optarg;
+			break;
+		case 'e':
+			events = optarg;
+			break;
+		case 'S':
+			shm_file = optarg;
+			break;
+		case 't':
+			stats_slow_usec = strtoull(optarg, NULL, 10);
+			slow_option = 1;
+			break;
 		case 'l':
 			addr_listen = optarg;
+			net_option = 1;
 			break;
 		case 'p':
 			port_listen = atoi(optarg);
+			net_option = 1;
 			break;
 		case 's':
 			addr_connect = optarg;
 			break;
 		case 'P':
 			port_connect = atoi(optarg);
+			net_option = 1;
 			break;
 		default:
 			usage();
@@ -140,31 +207,54 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	if ((conf_file != NULL) && (addr_connect != NULL)) {
-		printf("Use only configuration file or server address, not both\n");
-		goto error;
+	if (((conf_cache != NULL) || (conf_dir != NULL)) &&
+	    (conf_file == NULL)) {
+		usage();
+		exit(1);
 	}
 
-	if (conf_file != NULL) {
-		printf("Configuration file: %s\n", conf_file);
+	if ((conf_file != NULL) && ((addr_connect != NULL) || net_option)) {
+		printf("Use only configuration file or server and listen "
+		    "options, not both\n");
 		goto error;
 	}
 
-	memset(&sa_connect, 0, sizeof(sa_connect));
-	sa_connect.sin_family = AF_INET;
-	sa_connect.sin_addr.s_addr = inet_addr(addr_connect);
-	if (sa_connect.sin_addr.s_addr == INADDR_NONE) {
-		struct hostent *h;
-
-		if ((h = gethostbyname(addr_connect)) == NULL) {
-			fprintf(stderr, "gethostbyname: %s: %s\n",
-			    addr_connect, hstrerror(h_errno));
+	toml_set_memutil(mem_toml_malloc, mem_toml_free);
+	toml_set_arena(1);
+	if ((conf = mem_alloc(mem_toml, sizeof(*conf))) == NULL) {
+		perror("malloc");
+		goto error;
+	}
+	conf_init(conf);
+	if (conf_file != NULL) {
+		if (conf_load(conf_file, conf_cache, conf_dir, conf, err, sizeof(err))) {
+			fprintf(stderr, "%s: %s\n", conf_file, err);
 			goto error;
 		}
-		memcpy(&sa_connect.sin_addr.s_addr, h->h_addr,
-		    sizeof(in_addr_t));
+		addr_connect = conf->server_name;
+		port_connect = conf->server_port;
+		if (conf->listen_address[0])
+			addr_listen = conf->listen_address;
+		port_listen = conf->listen_port;
+	}
+	conf_publish(conf);
+	/* options given on the command line win over the file */
+	if (log_file == NULL && conf->log_destination[0])
+		log_file = conf->log_destination;
+	if (metrics == NULL && conf->metrics_listen[0])
+		metrics = conf->metrics_listen;
+	if (admin == NULL && conf->admin_socket[0])
+		admin = conf->admin_socket;
+	if (events == NULL && conf->events_socket[0])
+		events = conf->events_socket;
+	if (shm_file == NULL && conf->stats_file[0])
+		shm_file = conf->stats_file;
+
+	if (resolve(addr_connect, port_connect, &sa_connect)) {
+		fprintf(stderr, "gethostbyname: %s: %s\n",
+		    addr_connect, hstrerror(h_errno));
+		goto error;
 	}
-	sa_connect.sin_port = htons(port_connect);
 
 	if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
 		perror("socket");
@@ -202,14 +292,43 @@ main(int argc, char *argv[])
 		goto error;
         }
 
+	if (metrics != NULL && stats_listen(metrics))
+		goto error;
+	if (admin != NULL && admin_listen(admin))
+		goto error;
+	if (events != NULL && events_listen(events))
+		goto error;
+	if (shm_file != NULL && shm_open_file(shm_file))
+		goto error;
+
+	apply(conf);
+	if (log_init(log_file != NULL ? log_file : debug ? "stderr" :
+	    "syslog")) {
+		fprintf(stderr, "%s: %s\n", log_file, strerror(errno));
+		goto error;
+	}
+
 	if (!debug && daemon(0, 0)) {
 		perror("daemon");
 		goto error;
 	}
+	if (pipe(sig_pipe) ||
+	    fcntl(sig_pipe[0], F_SETFL, fcntl(sig_pipe[0], F_GETFL) |
+	    O_NONBLOCK) ||
+	    fcntl(sig_pipe[1], F_SETFL, fcntl(sig_pipe[1], F_GETFL) |
+	    O_NONBLOCK)) {
+		perror("pipe");
+		goto error;
+	}
 	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, sighandler);
+	signal(SIGUSR1, sighandler);
+	signal(SIGUSR2, sighandler);
 
 #ifdef __OpenBSD__
-	if (pledge("stdio inet dns", NULL) == -1) {
+	if (pledge(conf_cache != NULL ?
+	    "stdio rpath wpath cpath inet dns unix" : conf_file != NULL ?
+	    "stdio rpath inet dns unix" : "stdio inet dns unix", NULL) == -1) {
 		perror("pledge");
 		goto error;
 	}
@@ -217,22 +336,37 @@ main(int argc, char *argv[])
 
 	/* handle incoming client connections */
 	while (1) {
-		fd_set readfds;
+		fd_set readfds, writefds;
 		struct timeval tv;
-		int r;
+		int r, max_fd;
 
+		handle_signals();
+		log_flush();
+		shm_update();
 		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
 		FD_SET(listen_fd, &readfds);
+		FD_SET(sig_pipe[0], &readfds);
+		max_fd = stats_fdset(&readfds, &writefds,
+		    listen_fd > sig_pipe[0] ? listen_fd : sig_pipe[0]);
+		max_fd = admin_fdset(&readfds, &writefds, max_fd);
+		max_fd = events_fdset(&readfds, &writefds, max_fd);
 		memset(&tv, 0, sizeof(tv));
 		tv.tv_sec = 10;
-		r = select(listen_fd + 1, &readfds, NULL, NULL, &tv);
+		r = select(max_fd + 1, &readfds, &writefds, NULL, &tv);
 		if (r < 0) {
 			if (errno != EINTR) {
-				perror("select");
+				log_msg(LOG_ERR, logk_io, "select: %s",
+				    strerror(errno));
 				break;
 			}
 			continue;
 		}
+		if (r > 0) {
+			stats_process(&readfds, &writefds);
+			admin_process(&readfds, &writefds);
+			events_process(&readfds, &writefds);
+		}
 		if (r > 0 && FD_ISSET(listen_fd, &readfds)) {
 			int client_fd;
 
@@ -242,19 +376,24 @@ main(int argc, char *argv[])
 			    (struct sockaddr *)&sa, &len);
 			if (client_fd < 0) {
 				if (errno != ECONNABORTED) {
-					perror("accept");
+					log_msg(LOG_ERR, logk_io, "accept: %s",
+					    strerror(errno));
 					break;
 				}
 				continue;
 			}
-			printf("client connection from %s:%i\n",
+			log_msg(LOG_INFO, logk_session,
+			    "client connection from %s:%i",
 			    inet_ntoa(sa.sin_addr), ntohs(sa.sin_port));
+			stats.conn_accepted++;
+			PROBE1(session_accept, client_fd);
 			handle_client(client_fd);
 			close(client_fd);
 		}
 	}
 
 	close(listen_fd);
+	log_flush();
 	return (0);
 
 error:
@@ -271,33 +410,50 @@ handle_client(int client_fd)
 	int max_fd;
 	time_t t;
 	unsigned long bytes_in, bytes_out;
+	uint64_t t_connect;
+	char setup[160];
+	const char *abnormal = NULL;	/* why the session failed */
 
 	t = time(NULL);
 	bytes_in = bytes_out = 0;
 	irc_pass[0] = irc_nick[0] = irc_ident[0] = irc_channel[0] = 0;
 	icb_logged_in = 0;
 	terminate_client = 1;
+	stalled_fd = -1;
+	stats_phase(phase_accept);
+	flight_reset();
+	stats_session(client_fd, -1);
 
-	printf("connecting to server %s:%u\n",
+	log_msg(LOG_INFO, logk_session, "connecting to server %s:%u",
 	    inet_ntoa(sa_connect.sin_addr), ntohs(sa_connect.sin_port));
 	irc_send_notice(client_fd, "*** Connecting to server %s:%u",
 	    inet_ntoa(sa_connect.sin_addr), ntohs(sa_connect.sin_port));
 	if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("socket");
+		log_msg(LOG_ERR, logk_io, "socket: %s", strerror(errno));
+		stats.conn_rejected++;
 		goto done;
 	}
+	PROBE1(upstream_connect_start, server_fd);
+	t_connect = stats_now();
 	if (connect(server_fd, (struct sockaddr *)&sa_connect,
 	    sizeof(sa_connect))) {
-		perror("connect");
+		PROBE2(upstream_connect_done, server_fd, errno);
+		log_msg(LOG_ERR, logk_io, "connect: %s", strerror(errno));
 		irc_send_notice(client_fd, "*** Error: connect: %s",
 		    strerror(errno));
 		close(server_fd);
+		server_fd = -1;
+		stats.conn_rejected++;
 		goto done;
 	}
+	PROBE2(upstream_connect_done, server_fd, 0);
+	hist_add(&stats.connect_latency, stats_now() - t_connect);
+	stats_phase(phase_connect);
+	stats_session(client_fd, server_fd);
 
 	if (fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK) ||
 	    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK)) {
-		perror("fcntl");
+		log_msg(LOG_ERR, logk_io, "fcntl: %s", strerror(errno));
 		goto done;
 	}
 
@@ -305,24 +461,40 @@ handle_client(int client_fd)
 		max_fd = client_fd;
 	else
 		max_fd = server_fd;
+	if (sig_pipe[0] > max_fd)
+		max_fd = sig_pipe[0];
 
 	irc_send_notice(client_fd, "*** Connected");
 	terminate_client = 0;
 	icb_init();
+	irc_init();
 	while (!terminate_client) {
-		fd_set readfds;
+		fd_set readfds, writefds;
 		struct timeval tv;
 		int r;
 
+		handle_signals();
+		if (terminate_client)
+			break;
+		log_flush();
+		shm_update();
+		stats_tcpinfo();
 		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
 		FD_SET(server_fd, &readfds);
 		FD_SET(client_fd, &readfds);
+		FD_SET(sig_pipe[0], &readfds);
 		memset(&tv, 0, sizeof(tv));
                 tv.tv_sec = 10;
-                r = select(max_fd + 1, &readfds, NULL, NULL, &tv);
+                r = select(events_fdset(&readfds, &writefds,
+		    admin_fdset(&readfds, &writefds,
+		    stats_fdset(&readfds, &writefds, max_fd))) + 1,
+		    &readfds, &writefds, NULL, &tv);
                 if (r < 0) {
 			if (errno != EINTR) {
-				perror("select");
+				log_msg(LOG_ERR, logk_io, "select: %s",
+				    strerror(errno));
+				abnormal = "select error";
 				break;
 			}
 			continue;
@@ -331,37 +503,59 @@ handle_client(int client_fd)
 			char buf[65535];
 			int len;
 
+			stats_process(&readfds, &writefds);
+			admin_process(&readfds, &writefds);
+			events_process(&readfds, &writefds);
+			if (terminate_client)
+				break;
+
 			if (FD_ISSET(server_fd, &readfds)) {
 				len = read(server_fd, buf, sizeof(buf));
 				if (len < 0) {
 					if (errno == EINTR)
 						continue;
-					perror("read");
+					log_msg(LOG_ERR, logk_io, "read: %s",
+					    strerror(errno));
+					abnormal = "server read error";
 					len = 0;
 				}
 				if (len == 0) {
-					printf("connection closed by server\n");
+					if (abnormal == NULL)
+						abnormal = "closed by server";
+					log_msg(LOG_INFO, logk_session,
+					    "connection closed by server");
 					irc_send_notice(client_fd,
 					    "*** Connection closed by server");
 					break;
 				}
+				flight_add(flight_read_icb, 0, len,
+				    stats_outq(client_fd));
+				trace_read();
 				icb_recv(buf, len, client_fd, server_fd);
 				bytes_in += len;
+				stats_read(server_fd, len);
 			}
 			if (FD_ISSET(client_fd, &readfds)) {
 				len = read(client_fd, buf, sizeof(buf));
 				if (len < 0) {
 					if (errno == EINTR)
 						continue;
-					perror("read");
+					log_msg(LOG_ERR, logk_io, "read: %s",
+					    strerror(errno));
+					abnormal = "client read error";
 					len = 0;
 				}
 				if (len == 0) {
-					printf("connection closed by client\n");
+					log_msg(LOG_INFO, logk_session,
+					    "connection closed by client");
 					break;
 				}
+				flight_add(flight_read_irc, 0, len,
+				    stats_outq(server_fd));
+				trace_read();
 				irc_recv(buf, len, client_fd, server_fd);
 				bytes_out += len;
+				stats_read(client_fd, len);
 			}
 		}
 	}
@@ -369,12 +563,185 @@ handle_client(int client_fd)
 done:
 	if (server_fd >= 0)
 		close(server_fd);
-	printf("(%lu seconds, %lu:%lu bytes)\n",
-	    (unsigned long)(time(NULL) - t), bytes_out, bytes_in);
+	if (abnormal != NULL)
+		flight_dump(abnormal);
+	stats_phases(setup, sizeof(setup));
+	log_msg(LOG_INFO, logk_session, "(%lu seconds, %lu:%lu bytes, "
+	    "setup %s)", (unsigned long)(time(NULL) - t), bytes_out, bytes_in,
+	    setup);
 	if (terminate_client)
 		irc_send_notice(client_fd, "*** Closing connection "
 		    "(%u seconds, %lu:%lu bytes)",
 		    time(NULL) - t, bytes_out, bytes_in);
+	PROBE3(session_close, client_fd, bytes_out, bytes_in);
+	stats_session(-1, -1);
+	admin_session_end();
+}
+
+static void
+sighandler(int sig)
+{
+	int saved_errno = errno;
+
+	if (sig == SIGHUP)
+		got_sighup = 1;
+	else if (sig == SIGUSR1)
+		got_sigusr1 = 1;
+	else if (sig == SIGUSR2)
+		got_sigusr2 = 1;
+	if (write(sig_pipe[1], "", 1) < 0)
+		;	/* full pipe: a wakeup is already pending */
+	errno = saved_errno;
+}
+
+/*
+ * Signals are only flagged by the handler and acted upon here, from
+ * the select() loops. The handler also writes to sig_pipe, watched by
+ * the loops, so a signal arriving between this check and select() is
+ * not left waiting for the timeout. The pipe is drained before the
+ * flags are tested so that no wakeup is lost.
+ *
+ * SIGHUP reloads the configuration file. SIGUSR1 dumps the
+ * per-operation accounting and the flight recorder to the log, SIGUSR2
+ * switches accounting on or off.
+ *
+ * This is also the quiescent point of the configuration snapshots:
+ * nothing refers to a retired snapshot here.
+ */
+static void
+handle_signals(void)
+{
+	char buf[64];
+
+	while (read(sig_pipe[0], buf, sizeof(buf)) > 0)
+		;
+	conf_quiesce();
+	if (got_sighup) {
+		got_sighup = 0;
+		reload();
+	}
+	if (got_sigusr2) {
+		got_sigusr2 = 0;
+		prof_enabled = !prof_enabled;
+		log_msg(LOG_NOTICE, logk_dump, "accounting %s",
+		    prof_enabled ? "enabled" : "disabled");
+	}
+	if (got_sigusr1) {
+		got_sigusr1 = 0;
+		prof_dump();
+		flight_dump("signal");
+	}
+}
+
+/* address of the ICB server, non-zero with h_errno set on failure */
+static int
+resolve(const char *name, unsigned port, struct sockaddr_in *sa)
+{
+	struct hostent *h;
+
+	memset(sa, 0, sizeof(*sa));
+	sa->sin_family = AF_INET;
+	sa->sin_addr.s_addr = inet_addr(name);
+	if (sa->sin_addr.s_addr == INADDR_NONE) {
+		if ((h = gethostbyname(name)) == NULL)
+			return (1);
+		memcpy(&sa->sin_addr.s_addr, h->h_addr, sizeof(in_addr_t));
+	}
+	sa->sin_port = htons(port);
+	return (0);
+}
+
+/* settings that take effect at once, at startup and on reload */
+static void
+apply(const struct conf *c)
+{
+	if (!slow_option)
+		stats_slow_usec = c->log_slow_usec;
+	if (debug)
+		log_level = LOG_DEBUG;
+	else if (conf_level(c) >= 0)
+		log_level = conf_level(c);
+	log_limit = c->log_rate;
+	events_queue = c->events_queue;
+	write_timeout = c->timeout_write;
+}
+
+/*
+ * Read the configuration file again and switch to it if it is valid.
+ * A session in progress keeps its server connection, unless the server
+ * changed: it is then closed, the client can reconnect. Listeners and
+ * the log destination are only set up at startup, changes to them are
+ * reported and ignored.
+ */
+static void
+reload(void)
+{
+	const struct conf *old = conf_current;
+	struct sockaddr_in sa;
+	struct conf *c;
+	char err[256];
+
+	if (conf_file == NULL) {
+		log_msg(LOG_NOTICE, logk_session, "reload: no configuration "
+		    "file");
+		return;
+	}
+	if ((c = mem_alloc(mem_toml, sizeof(*c))) == NULL) {
+		log_msg(LOG_ERR, logk_session, "reload: %s", strerror(errno));
+		return;
+	}
+	conf_init(c);
+	if (conf_load(conf_file, conf_cache, conf_dir, c, err, sizeof(err))) {
+		log_msg(LOG_ERR, logk_session, "reload: %s: %s", conf_file,
+		    err);
+		mem_free(mem_toml, c);
+		return;
+	}
+	if (resolve(c->server_name, c->server_port, &sa)) {
+		log_msg(LOG_ERR, logk_session, "reload: gethostbyname: %s: %s",
+		    c->server_name, hstrerror(h_errno));
+		mem_free(mem_toml, c);
+		return;
+	}
+	if (strcmp(c->listen_address, old->listen_address) ||
+	    c->listen_port != old->listen_port ||
+	    strcmp(c->log_destination, old->log_destination) ||
+	    strcmp(c->metrics_listen, old->metrics_listen) ||
+	    strcmp(c->admin_socket, old->admin_socket) ||
+	    strcmp(c->events_socket, old->events_socket) ||
+	    strcmp(c->stats_file, old->stats_file)) {
+		log_msg(LOG_WARNING, logk_session, "reload: listeners and "
+		    "log destination are not changed until restart");
+		/* the snapshot tells what is in effect */
+		memcpy(c->listen_address, old->listen_address,
+		    sizeof(c->listen_address));
+		c->listen_port = old->listen_port;
+		memcpy(c->log_destination, old->log_destination,
+		    sizeof(c->log_destination));
+		memcpy(c->metrics_listen, old->metrics_listen,
+		    sizeof(c->metrics_listen));
+		memcpy(c->admin_socket, old->admin_socket,
+		    sizeof(c->admin_socket));
+		memcpy(c->events_socket, old->events_socket,
+		    sizeof(c->events_socket));
+		memcpy(c->stats_file, old->stats_file, sizeof(c->stats_file));
+	}
+
+	if (sa.sin_addr.s_addr != sa_connect.sin_addr.s_addr ||
+	    sa.sin_port != sa_connect.sin_port) {
+		log_msg(LOG_NOTICE, logk_session, "reload: server is now "
+		    "%s:%u", inet_ntoa(sa.sin_addr), ntohs(sa.sin_port));
+		if (session.client_fd >= 0) {
+			irc_send_notice(session.client_fd, "*** Server "
+			    "changed, please reconnect");
+			terminate_client = 1;
+		}
+		sa_connect = sa;
+	}
+	conf_publish(c);
+	apply(c);
+	log_msg(LOG_NOTICE, logk_session, "configuration reloaded from %s",
+	    conf_file);
 }
 
 int
@@ -382,6 +749,9 @@ sync_write(int fd, const char *buf, int len)
 {
 	int off = 0;
 
+	/* the session is ending, don't wait on the peer again */
+	if (fd == stalled_fd)
+		return (1);
 	while (len > off) {
 		fd_set writefds;
 		struct timeval tv;
@@ -390,23 +760,36 @@ sync_write(int fd, const char *buf, int len)
 		FD_ZERO(&writefds);
 		FD_SET(fd, &writefds);
 		memset(&tv, 0, sizeof(tv));
-		tv.tv_sec = 10;
+		tv.tv_sec = write_timeout ? write_timeout : 10;
 		r = select(fd + 1, NULL, &writefds, NULL, &tv);
 		if (r < 0) {
 			if (errno != EINTR) {
-				perror("select");
+				log_msg(LOG_ERR, logk_io, "select: %s",
+				    strerror(errno));
 				return (1);
 			}
 			continue;
 		}
+		if (r == 0 && write_timeout) {
+			log_msg(LOG_ERR, logk_io, "write: timeout after %u "
+			    "seconds", write_timeout);
+			stalled_fd = fd;
+			terminate_client = 1;
+			return (1);
+		}
 		if (r > 0 && FD_ISSET(fd, &writefds)) {
 			r = write(fd, buf + off, len - off);
+			prof_writes++;
 			if (r < 0) {
-				perror("write");
+				log_msg(LOG_ERR, logk_io, "write: %s",
+				    strerror(errno));
 				return (1);
 			}
 			off += r;
+			prof_bytes += r;
 		}
 	}
+	stats_write(fd, len);
+	PROBE2(write, fd, len);
 	return (0);
 }
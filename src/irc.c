@@ -32,14 +32,21 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include "flight.h"
+#include "hitters.h"
 #include "irc.h"
 #include "icb.h"
+#include "log.h"
+#include "mem.h"
+#include "probes.h"
+#include "prof.h"
+#include "stats.h"
 
 extern void	 scan(const char **, char *, size_t, const char *,
 		    const char *);
 extern int	 sync_write(int, const char *, int);
 
-static void	 irc_cmd(char *, int, int);
+static int	 irc_cmd(char *, int, int);
 
 static void	 irc_send_pong(int, const char *);
 
@@ -51,6 +58,13 @@ char irc_nick[256];
 char irc_channel[256];
 int in_irc_channel;
 
+static char line[65535];	/* being assembled, see irc_recv() */
+
+/* verbs counted separately in stats, others are counted as "other" */
+const char *irc_verbs[] = { "PASS", "USER", "NICK", "JOIN", "PART", "PRIVMSG",
+    "NOTICE", "MODE", "TOPIC", "LIST", "NAMES", "WHOIS", "WHO", "KICK", "PING",
+    "QUIT", "CAP", "RAWICB", NULL };
+
 /*
  * irc_recv() receives read(2) chunks and assembles complete lines, which are
  * passed to irc_cmd(). Overlong lines are truncated after 65kB.
@@ -59,46 +73,69 @@ int in_irc_channel;
  *
  */
 
+/* account the buffers of the IRC side, called when a session starts */
+void
+irc_init(void)
+{
+	mem_static(mem_session, irc_pass, sizeof(irc_pass));
+	mem_static(mem_session, irc_ident, sizeof(irc_ident));
+	mem_static(mem_session, irc_nick, sizeof(irc_nick));
+	mem_static(mem_session, irc_channel, sizeof(irc_channel));
+	mem_static(mem_input, line, sizeof(line));
+}
+
 void
 irc_recv(const char *buf, unsigned len, int client_fd, int server_fd)
 {
-	static char cmd[65535];
+	char *cmd = line;
 	static unsigned off = 0;
 
 	while (len > 0) {
-		while (len > 0 && off < (sizeof(cmd) - 1) && *buf != '\n') {
+		while (len > 0 && off < (sizeof(line) - 1) && *buf != '\n') {
 			cmd[off++] = *buf++;
 			len--;
 		}
-		if (off == (sizeof(cmd) - 1))
+		if (off == (sizeof(line) - 1))
 			while (len > 0 && *buf != '\n') {
 				buf++;
 				len--;
 			}
-		/* off <= sizeof(cmd) - 1 */
+		/* off <= sizeof(line) - 1 */
 		if (len > 0 && *buf == '\n') {
+			struct prof_sample ps = { 0 };
+			int verb;
+
 			buf++;
 			len--;
 			if (off > 0 && cmd[off - 1] == '\r')
 				cmd[off - 1] = 0;
 			else
 				cmd[off] = 0;
-			irc_cmd(cmd, client_fd, server_fd);
+			stats.packets[dir_irc_in]++;
+			trace_begin(fwd_irc_to_icb);
+			PROF_BEGIN(&ps);
+			verb = irc_cmd(cmd, client_fd, server_fd);
+			PROF_END(&ps, prof_irc, verb);
+			trace_end(verb);
+			flight_add(flight_irc, verb, off, 0);
+			stats.irc_verb[verb]++;
 			off = 0;
 		}
 	}
 }
 
-static void
+/* returns the index of the command in irc_verbs, for accounting */
+static int
 irc_cmd(char *cmd, int client_fd, int server_fd)
 {
 	if (!strncasecmp(cmd, "RAWICB ", 7)) {
+		PROBE1(irc_command, "RAWICB");
 		icb_send_raw(server_fd, cmd + 7);
-		return;
+		return (irc_verb_index("RAWICB"));
 	}
 
 	char *argv[10], *p;
-	int argc = 1;
+	int argc = 1, verb;
 
 	for (p = cmd, argv[0] = p; argc < 10 && (p = strchr(p, ' ')) != NULL;
 	    argc++) {
@@ -112,21 +149,27 @@ irc_cmd(char *cmd, int client_fd, int server_fd)
 		}
 		argv[argc] = p;
 	}
+	verb = irc_verb_index(argv[0]);
+	PROBE1(irc_command, argv[0]);
 
 	if (!strcasecmp(argv[0], "PASS")) {
 		strlcpy(irc_pass, argv[1], sizeof(irc_pass));
 	} else if (!strcasecmp(argv[0], "USER")) {
 		strlcpy(irc_ident, argv[1], sizeof(irc_ident));
-		if (!icb_logged_in && irc_nick[0] && irc_ident[0])
+		if (!icb_logged_in && irc_nick[0] && irc_ident[0]) {
+			stats_phase(phase_register);
 			icb_send_login(server_fd, irc_nick,
 			    irc_ident, irc_pass);
+		}
 	} else if (!strcasecmp(argv[0], "NICK")) {
 		strlcpy(irc_nick, argv[1], sizeof(irc_nick));
 		if (icb_logged_in)
 			icb_send_name(server_fd, irc_nick);
-		else if (irc_nick[0] && irc_ident[0])
+		else if (irc_nick[0] && irc_ident[0]) {
+			stats_phase(phase_register);
 			icb_send_login(server_fd, irc_nick,
 			    irc_ident, irc_pass);
+		}
 	} else if (!strcasecmp(argv[0], "JOIN")) {
 		icb_send_group(server_fd,
 		    argv[1] + (argv[1][0] == '#' ? 1 : 0));
@@ -148,28 +191,30 @@ irc_cmd(char *cmd, int client_fd, int server_fd)
 			} else
 				i++;
 		}
-		if (!strcmp(argv[1], irc_channel))
+		hh_add(hh_nick, irc_nick);
+		if (!strcmp(argv[1], irc_channel)) {
+			hh_add(hh_group, irc_channel);
 			icb_send_openmsg(server_fd, msg);
-		else
+		} else
 			icb_send_privmsg(server_fd, argv[1], msg);
 	} else if (!strcasecmp(argv[0], "MODE")) {
 		if (strcmp(argv[1], irc_channel))
-			return;
+			return (verb);
 		if (argc == 2)
 			icb_send_names(server_fd, irc_channel);
 		else {
 			if (strcmp(argv[2], "+o")) {
-				printf("irc_cmd: invalid MODE args '%s'\n",
-				    argv[2]);
-				return;
+				log_msg(LOG_DEBUG, logk_client,
+				    "irc_cmd: invalid MODE args '%s'", argv[2]);
+				return (verb);
 			}
 			icb_send_pass(server_fd, argv[3]);
 		}
 	} else if (!strcasecmp(argv[0], "TOPIC")) {
 		if (strcmp(argv[1], irc_channel)) {
-			printf("irc_cmd: invalid TOPIC channel '%s'\n",
-			    argv[1]);
-			return;
+			log_msg(LOG_DEBUG, logk_client,
+			    "irc_cmd: invalid TOPIC channel '%s'", argv[1]);
+			return (verb);
 		}
 		icb_send_topic(server_fd, argv[2]);
 	} else if (!strcasecmp(argv[0], "LIST")) {
@@ -182,15 +227,16 @@ irc_cmd(char *cmd, int client_fd, int server_fd)
 		icb_send_who(server_fd, argv[1]);
 	} else if (!strcasecmp(argv[0], "KICK")) {
 		if (strcmp(argv[1], irc_channel)) {
-			printf("irc_cmd: invalid KICK args '%s'\n", argv[1]);
-			return;
+			log_msg(LOG_DEBUG, logk_client,
+			    "irc_cmd: invalid KICK args '%s'", argv[1]);
+			return (verb);
 		}
 		icb_send_boot(server_fd, argv[2]);
 	} else if (!strcasecmp(argv[0], "PING")) {
 		icb_send_noop(server_fd);
 		irc_send_pong(client_fd, argv[1]);
 	} else if (!strcasecmp(argv[0], "QUIT")) {
-		printf("client QUIT\n");
+		log_msg(LOG_INFO, logk_session, "client QUIT");
 		terminate_client = 1;
 	} else if (!strcasecmp(argv[0], "CAP")) {
 		/*
@@ -201,7 +247,21 @@ irc_cmd(char *cmd, int client_fd, int server_fd)
 		 * capability negotiation.
 		 */
 	} else
-		printf("irc_cmd: unknown command '%s'\n", argv[0]);
+		log_msg(LOG_DEBUG, logk_client, "irc_cmd: unknown command '%s'",
+		    argv[0]);
+	return (verb);
+}
+
+/* index of verb in irc_verbs, or of the terminating NULL if unknown */
+int
+irc_verb_index(const char *verb)
+{
+	int i;
+
+	for (i = 0; irc_verbs[i] != NULL; ++i)
+		if (!strcasecmp(verb, irc_verbs[i]))
+			break;
+	return (i);
 }
 
 void
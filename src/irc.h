@@ -1,6 +1,7 @@
 #ifndef _IRC_H_
 #define _IRC_H_
 
+void	 irc_init(void);
 void	 irc_recv(const char *, unsigned, int, int);
 void	 irc_send_notice(int, const char *, ...);
 void	 irc_send_code(int, const char *, const char *, const char *,
@@ -8,6 +9,9 @@ void	 irc_send_code(int, const char *, const char *, const char *,
 void	 irc_send_msg(int, const char *, const char *, const char *);
 void	 irc_send_join(int, const char *, const char *);
 void	 irc_send_part(int, const char *, const char *);
+int	 irc_verb_index(const char *);
+
+extern const char *irc_verbs[];
 
 extern char irc_pass[256];
 extern char irc_ident[256];
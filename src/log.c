@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2023-2024 Laurent Cheylus <foxy@free.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "mem.h"
+
+/*
+ * log_msg() only formats the message text into the next free slot of
+ * a ring and returns, it never blocks nor calls into stdio. The ring
+ * is drained by log_flush(), which the select() loops call before
+ * waiting for data, so the actual I/O happens when the proxy is idle:
+ * one writev(2) per batch of lines for a file or stderr, or syslog(3).
+ *
+ * The process is single-threaded, the ring is only ever touched from
+ * the main thread and needs no locking. When the ring is full, lines
+ * are dropped and counted. Each message kind is limited to log_limit
+ * lines per second; suppressed lines are counted and reported.
+ */
+
+#define LOG_RING	512
+#define LOG_LINE	256
+#define LOG_RATE	20
+#define LOG_BATCH	64
+
+int log_level = LOG_INFO;
+unsigned log_limit = LOG_RATE;
+
+static struct log_entry {
+	time_t		 t;
+	int		 level;
+	unsigned	 len;
+	char		 line[LOG_LINE];
+} log_ring[LOG_RING];
+static unsigned log_head, log_tail;	/* next slot to write, to read */
+static unsigned long log_dropped;
+
+static struct {
+	time_t		 window;
+	unsigned	 count;
+	unsigned long	 suppressed;
+} log_rate[logk_max];
+
+static const char *log_kinds[logk_max] = { "session", "client", "server",
+    "io", "slow", "dump" };
+
+static int log_fd = STDERR_FILENO;
+static int log_syslog = 0;
+
+static void	 log_put(time_t, int, const char *, ...)
+		    __attribute__((format(printf, 3, 4)));
+static void	 log_vput(time_t, int, const char *, va_list);
+
+/*
+ * Select the log destination: "syslog", "stderr" or the path of a file
+ * to append to. Returns non-zero if the file cannot be opened.
+ */
+int
+log_init(const char *dest)
+{
+	int fd;
+
+	log_flush();
+	if (log_syslog) {
+		closelog();
+		log_syslog = 0;
+	}
+	if (log_fd != STDERR_FILENO)
+		close(log_fd);
+	log_fd = STDERR_FILENO;
+	mem_static(mem_log, log_ring, sizeof(log_ring));
+
+	if (!strcmp(dest, "syslog")) {
+		openlog("icbirc", LOG_PID | LOG_NDELAY, LOG_DAEMON);
+		log_syslog = 1;
+	} else if (strcmp(dest, "stderr")) {
+		if ((fd = open(dest, O_WRONLY | O_APPEND | O_CREAT, 0640)) < 0)
+			return (1);
+		log_fd = fd;
+	}
+	return (0);
+}
+
+static void
+log_vput(time_t t, int level, const char *format, va_list ap)
+{
+	struct log_entry *e;
+	int len;
+
+	if (log_head - log_tail == LOG_RING) {
+		log_dropped++;
+		return;
+	}
+	e = &log_ring[log_head % LOG_RING];
+	len = vsnprintf(e->line, sizeof(e->line) - 1, format, ap);
+	if (len < 0)
+		return;
+	if (len > (int)sizeof(e->line) - 2)
+		len = sizeof(e->line) - 2;
+	e->line[len++] = '\n';
+	e->line[len] = 0;
+	e->len = len;
+	e->t = t;
+	e->level = level;
+	log_head++;
+}
+
+static void
+log_put(time_t t, int level, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	log_vput(t, level, format, ap);
+	va_end(ap);
+}
+
+void
+log_msg(int level, int kind, const char *format, ...)
+{
+	va_list ap;
+	time_t t;
+
+	if (level > log_level)
+		return;
+	t = time(NULL);
+	if (kind != logk_dump) {
+		if (log_rate[kind].window != t) {
+			log_rate[kind].window = t;
+			log_rate[kind].count = 0;
+		}
+		if (log_rate[kind].count++ >= log_limit) {
+			log_rate[kind].suppressed++;
+			return;
+		}
+	}
+	va_start(ap, format);
+	log_vput(t, level, format, ap);
+	va_end(ap);
+}
+
+void
+log_flush(void)
+{
+	struct iovec iov[LOG_BATCH * 2];
+	char stamp[LOG_BATCH][32];
+	time_t t = time(NULL);
+	int i, n;
+
+	for (i = 0; i < logk_max; ++i)
+		if (log_rate[i].suppressed && log_rate[i].window != t) {
+			log_put(t, LOG_NOTICE, "log: %lu %s messages "
+			    "suppressed", log_rate[i].suppressed,
+			    log_kinds[i]);
+			log_rate[i].suppressed = 0;
+		}
+	if (log_dropped && log_head - log_tail < LOG_RING) {
+		log_put(t, LOG_NOTICE, "log: %lu messages dropped",
+		    log_dropped);
+		log_dropped = 0;
+	}
+
+	while (log_tail != log_head) {
+		for (n = 0; n < LOG_BATCH && log_tail != log_head; ++n) {
+			struct log_entry *e = &log_ring[log_tail++ % LOG_RING];
+
+			if (log_syslog) {
+				e->line[e->len - 1] = 0;
+				syslog(e->level, "%s", e->line);
+				continue;
+			}
+			strftime(stamp[n], sizeof(stamp[n]), "%b %e %H:%M:%S ",
+			    localtime(&e->t));
+			iov[n * 2].iov_base = stamp[n];
+			iov[n * 2].iov_len = strlen(stamp[n]);
+			iov[n * 2 + 1].iov_base = e->line;
+			iov[n * 2 + 1].iov_len = e->len;
+		}
+		/* nowhere to report a failure */
+		if (!log_syslog && n > 0 && writev(log_fd, iov, n * 2) < 0)
+			break;
+	}
+}
@@ -0,0 +1,18 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <syslog.h>
+
+/* message kinds, each rate-limited separately (except dumps) */
+enum { logk_session, logk_client, logk_server, logk_io, logk_slow,
+    logk_dump, logk_max };
+
+extern int log_level;
+extern unsigned log_limit;	/* lines per second and kind */
+
+int	 log_init(const char *);
+void	 log_msg(int, int, const char *, ...)
+	    __attribute__((format(printf, 3, 4)));
+void	 log_flush(void);
+
+#endif
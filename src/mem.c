@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2023-2024 Laurent Cheylus <foxy@free.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "mem.h"
+#include "stats.h"
+
+/*
+ * Heap blocks carry a header with their size, so that freeing a block
+ * knows how much to take off its subsystem. The header is as large as
+ * the strictest alignment, blocks stay suitably aligned for any type.
+ *
+ * Fixed buffers are registered by address: a subsystem can register
+ * the same buffer again, e.g. every time a session starts, and it is
+ * only counted once.
+ */
+
+#define MEM_STATIC	32	/* registered fixed buffers */
+
+union mem_header {
+	size_t		 len;
+	long double	 align;
+};
+
+const char *mem_names[mem_max] = { "session", "input", "output", "query",
+    "toml", "log", "stats" };
+
+struct mem_usage mem_usage[mem_max];
+
+static const void *mem_fixed[MEM_STATIC];
+static unsigned mem_nfixed;
+
+void *
+mem_alloc(int cat, size_t len)
+{
+	return (mem_realloc(cat, NULL, len));
+}
+
+void *
+mem_realloc(int cat, void *p, size_t len)
+{
+	union mem_header *h = NULL;
+	size_t old = 0;
+
+	if (p != NULL) {
+		h = (union mem_header *)p - 1;
+		old = h->len;
+	}
+	if ((h = realloc(h, sizeof(*h) + len)) == NULL)
+		return (NULL);
+	h->len = len;
+	/*
+	 * Atomic: the files of a configuration directory are parsed by
+	 * several threads, see conf.c.
+	 */
+	if (p == NULL)
+		__atomic_add_fetch(&mem_usage[cat].blocks, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&mem_usage[cat].allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&mem_usage[cat].heap, len - old, __ATOMIC_RELAXED);
+	return (h + 1);
+}
+
+void
+mem_free(int cat, void *p)
+{
+	union mem_header *h;
+
+	if (p == NULL)
+		return;
+	h = (union mem_header *)p - 1;
+	__atomic_sub_fetch(&mem_usage[cat].heap, h->len, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&mem_usage[cat].blocks, 1, __ATOMIC_RELAXED);
+	free(h);
+}
+
+/* for toml_set_memutil() */
+void *
+mem_toml_malloc(size_t len)
+{
+	return (mem_alloc(mem_toml, len));
+}
+
+void
+mem_toml_free(void *p)
+{
+	mem_free(mem_toml, p);
+}
+
+void
+mem_static(int cat, const void *p, size_t len)
+{
+	unsigned i;
+
+	for (i = 0; i < mem_nfixed; ++i)
+		if (mem_fixed[i] == p)
+			return;
+	if (mem_nfixed == MEM_STATIC)
+		return;
+	mem_fixed[mem_nfixed++] = p;
+	mem_usage[cat].fixed += len;
+}
+
+/* admin socket report */
+void
+mem_write(struct buf *b)
+{
+	struct mem_usage t = { 0, 0, 0, 0 };
+	int i;
+
+	bprintf(b, "%-10s %12s %10s %12s %12s\n", "subsystem", "heap",
+	    "blocks", "allocs", "static");
+	for (i = 0; i <= mem_max; ++i) {
+		const struct mem_usage *u = i < mem_max ? &mem_usage[i] : &t;
+
+		bprintf(b, "%-10s %12llu %10llu %12llu %12llu\n",
+		    i < mem_max ? mem_names[i] : "total",
+		    (unsigned long long)u->heap, (unsigned long long)u->blocks,
+		    (unsigned long long)u->allocs,
+		    (unsigned long long)u->fixed);
+		if (i < mem_max) {
+			t.heap += u->heap;
+			t.blocks += u->blocks;
+			t.allocs += u->allocs;
+			t.fixed += u->fixed;
+		}
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef _MEM_H_
+#define _MEM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Memory accounting by subsystem: heap allocations made through
+ * mem_alloc() and friends, and the fixed buffers that subsystems
+ * register with mem_static(), are added up per subsystem so that a
+ * growing process can be explained without a heap profiler.
+ */
+
+enum { mem_session, mem_input, mem_output, mem_query, mem_toml, mem_log,
+    mem_stats, mem_max };
+
+struct mem_usage {
+	uint64_t	 heap;		/* live heap bytes */
+	uint64_t	 blocks;	/* live heap allocations */
+	uint64_t	 allocs;	/* heap allocations ever made */
+	uint64_t	 fixed;		/* static buffers */
+};
+
+struct buf;
+
+extern const char *mem_names[];
+extern struct mem_usage mem_usage[];
+
+void	*mem_alloc(int, size_t);
+void	*mem_realloc(int, void *, size_t);
+void	 mem_free(int, void *);
+void	*mem_toml_malloc(size_t);
+void	 mem_toml_free(void *);
+void	 mem_static(int, const void *, size_t);
+void	 mem_write(struct buf *);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/*
+ * USDT probes of provider "icbirc", listed with
+ * `bpftrace -l 'usdt:/usr/local/bin/icbirc:*'`:
+ *
+ *   session_accept(fd)                   client connection accepted
+ *   session_close(fd, bytes_out, bytes_in)
+ *   upstream_connect_start(fd)
+ *   upstream_connect_done(fd, errno)     errno 0 on success
+ *   icb_packet(cmd, len)                 ICB packet complete in icb_recv()
+ *   irc_command(verb)                    irc_cmd() dispatch, verb is a string
+ *   write(fd, len)                       sync_write() done
+ *   query_start(mode)                    ICB who query sent by icb_send_hw()
+ *   query_end(mode)                      "Total:" seen by icb_ico()
+ *
+ * The probes are compiled in when <sys/sdt.h> is available (the
+ * Makefile then defines HAVE_SYS_SDT_H) and are a single nop until a
+ * tracer attaches; otherwise the macros expand to nothing.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE1(name, a)		DTRACE_PROBE1(icbirc, name, a)
+#define PROBE2(name, a, b)	DTRACE_PROBE2(icbirc, name, a, b)
+#define PROBE3(name, a, b, c)	DTRACE_PROBE3(icbirc, name, a, b, c)
+#else
+#define PROBE1(name, a)		do { } while (0)
+#define PROBE2(name, a, b)	do { } while (0)
+#define PROBE3(name, a, b, c)	do { } while (0)
+#endif
+
+#endif
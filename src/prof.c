@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2023-2024 Laurent Cheylus <foxy@free.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "icb.h"
+#include "irc.h"
+#include "log.h"
+#include "prof.h"
+
+/*
+ * Counters are kept per kind of operation, indexed by:
+ *
+ *   prof_icb     ICB command byte, around icb_cmd()
+ *   prof_status  ICB status message type (icb_status_types), for 'd'
+ *   prof_irc     IRC verb (irc_verbs), around irc_cmd()
+ *   prof_iwl     query mode (icb_imodes), around icb_iwl()
+ *   prof_ico     query mode (icb_imodes), around icb_ico()
+ *
+ * Nested operations are counted inclusively, e.g. the writes of an
+ * icb_ico() call are also accounted to the enclosing 'i' command.
+ * Cycles come from the TSC where available, nanoseconds otherwise.
+ */
+
+int prof_enabled = 0;
+uint64_t prof_writes = 0;
+uint64_t prof_bytes = 0;
+
+static struct prof_counter prof[prof_max][PROF_SLOTS];
+
+static const char *prof_kinds[prof_max] = { "icb", "status", "irc", "iwl",
+    "ico" };
+
+static uint64_t	 prof_cycles(void);
+static void	 prof_print(const char *, const char *,
+		    const struct prof_counter *, void *);
+
+static uint64_t
+prof_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return (__rdtsc());
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+}
+
+void
+prof_begin(struct prof_sample *s)
+{
+	s->active = 1;
+	s->writes = prof_writes;
+	s->bytes = prof_bytes;
+	s->cycles = prof_cycles();
+}
+
+void
+prof_end(struct prof_sample *s, int kind, int idx)
+{
+	struct prof_counter *c = &prof[kind][idx & (PROF_SLOTS - 1)];
+
+	c->cycles += prof_cycles() - s->cycles;
+	c->calls++;
+	c->writes += prof_writes - s->writes;
+	c->bytes += prof_bytes - s->bytes;
+}
+
+void
+prof_reset(void)
+{
+	memset(prof, 0, sizeof(prof));
+}
+
+/* call cb for every counter that was used, with kind and operation name */
+void
+prof_foreach(void (*cb)(const char *, const char *,
+    const struct prof_counter *, void *), void *arg)
+{
+	char name[8];
+	const char *op;
+	int kind, i, n;
+
+	for (kind = 0; kind < prof_max; ++kind) {
+		for (i = 0; i < PROF_SLOTS; ++i) {
+			if (prof[kind][i].calls == 0)
+				continue;
+			switch (kind) {
+			case prof_icb:
+				if (i >= 'a' && i <= 'z')
+					snprintf(name, sizeof(name), "%c", i);
+				else
+					snprintf(name, sizeof(name), "0x%02x",
+					    i);
+				op = name;
+				break;
+			case prof_status:
+				for (n = 0; icb_status_types[n] != NULL &&
+				    n < i; ++n)
+					;
+				op = icb_status_types[n] != NULL ?
+				    icb_status_types[n] : "other";
+				break;
+			case prof_irc:
+				for (n = 0; irc_verbs[n] != NULL && n < i; ++n)
+					;
+				op = irc_verbs[n] != NULL ? irc_verbs[n] :
+				    "other";
+				break;
+			default:
+				op = icb_imodes[i];
+				break;
+			}
+			cb(prof_kinds[kind], op, &prof[kind][i], arg);
+		}
+	}
+}
+
+static void
+prof_print(const char *kind, const char *op, const struct prof_counter *c,
+    void *arg)
+{
+	log_msg(LOG_INFO, logk_dump,
+	    "%-8s %-10s %10llu %14llu %10llu %10llu %12llu", kind, op,
+	    (unsigned long long)c->calls, (unsigned long long)c->cycles,
+	    (unsigned long long)(c->cycles / c->calls),
+	    (unsigned long long)c->writes, (unsigned long long)c->bytes);
+}
+
+void
+prof_dump(void)
+{
+	log_msg(LOG_INFO, logk_dump, "accounting %s",
+	    prof_enabled ? "enabled" : "disabled");
+	log_msg(LOG_INFO, logk_dump, "%-8s %-10s %10s %14s %10s %10s %12s",
+	    "kind", "op", "calls", "cycles", "cyc/call", "writes", "bytes");
+	prof_foreach(prof_print, NULL);
+}
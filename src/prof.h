@@ -0,0 +1,44 @@
+#ifndef _PROF_H_
+#define _PROF_H_
+
+#include <stdint.h>
+
+/*
+ * Per-operation accounting of calls, CPU cycles and write syscalls.
+ * PROF_BEGIN()/PROF_END() cost a single test of prof_enabled when
+ * accounting is switched off.
+ */
+
+enum { prof_icb, prof_status, prof_irc, prof_iwl, prof_ico, prof_max };
+
+#define PROF_SLOTS	256
+
+struct prof_counter {
+	uint64_t	calls;
+	uint64_t	cycles;
+	uint64_t	writes;		/* write(2) syscalls */
+	uint64_t	bytes;		/* bytes written */
+};
+
+struct prof_sample {
+	int		active;
+	uint64_t	cycles;
+	uint64_t	writes;
+	uint64_t	bytes;
+};
+
+#define PROF_BEGIN(s)	do { if (prof_enabled) prof_begin(s); } while (0)
+#define PROF_END(s, kind, idx) \
+			do { if ((s)->active) prof_end(s, kind, idx); } while (0)
+
+extern int prof_enabled;
+extern uint64_t prof_writes, prof_bytes;
+
+void	 prof_begin(struct prof_sample *);
+void	 prof_end(struct prof_sample *, int, int);
+void	 prof_foreach(void (*)(const char *, const char *,
+	    const struct prof_counter *, void *), void *);
+void	 prof_dump(void);
+void	 prof_reset(void);
+
+#endif
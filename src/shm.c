@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2023-2024 Laurent Cheylus <foxy@free.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <bsd/string.h>
+#include "irc.h"
+#include "shm.h"
+#include "stats.h"
+
+/*
+ * The statistics file is refreshed from the top of the select() loops,
+ * i.e. once after each batch of reads, by copying the counters kept in
+ * struct stats and struct session. Readers never interact with the
+ * proxy, however often they look.
+ */
+
+static struct shm_file *shm = NULL;
+
+#define SHM_WRITE_BEGIN(p) do {						\
+	__atomic_store_n(&(p)->seq, (p)->seq + 1, __ATOMIC_RELAXED);	\
+	__atomic_thread_fence(__ATOMIC_RELEASE);			\
+} while (0)
+#define SHM_WRITE_END(p) \
+	__atomic_store_n(&(p)->seq, (p)->seq + 1, __ATOMIC_RELEASE)
+
+/* create the statistics file at path, non-zero on error */
+int
+shm_open_file(const char *path)
+{
+	void *p;
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return (1);
+	}
+	if (ftruncate(fd, sizeof(*shm))) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		close(fd);
+		return (1);
+	}
+	p = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	    0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		return (1);
+	}
+	shm = p;
+	shm->header.version = SHM_VERSION;
+	shm->header.size = sizeof(*shm);
+	shm->header.slots = SHM_SLOTS;
+	shm->header.started = time(NULL);
+	/* magic last, readers check it first */
+	__atomic_store_n(&shm->header.magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	return (0);
+}
+
+void
+shm_update(void)
+{
+	struct shm_global *g;
+	struct shm_slot *s;
+	int i;
+
+	if (shm == NULL)
+		return;
+	/* the pid changes with daemon(3), after the file is created */
+	if (shm->header.pid == 0)
+		shm->header.pid = getpid();
+
+	g = &shm->global;
+	SHM_WRITE_BEGIN(g);
+	g->updated = time(NULL);
+	g->sessions_active = stats.sessions_active;
+	g->conn_accepted = stats.conn_accepted;
+	g->conn_rejected = stats.conn_rejected;
+	for (i = 0; i < dir_max; ++i) {
+		g->bytes[i] = stats.bytes[i];
+		g->packets[i] = stats.packets[i];
+	}
+	SHM_WRITE_END(g);
+
+	if (session.id == 0)
+		return;
+	s = &shm->slot[session.id % SHM_SLOTS];
+	if (s->id == session.id && !s->active && session.client_fd < 0)
+		return;
+	SHM_WRITE_BEGIN(s);
+	s->id = session.id;
+	s->active = session.client_fd >= 0;
+	s->started = session.start;
+	s->last_read = session.last_read;
+	for (i = 0; i < dir_max; ++i) {
+		s->bytes[i] = session.bytes[i];
+		s->packets[i] = stats.packets[i] - session.packets_base[i];
+	}
+	strlcpy(s->nick, irc_nick, sizeof(s->nick));
+	strlcpy(s->group, irc_channel, sizeof(s->group));
+	SHM_WRITE_END(s);
+}
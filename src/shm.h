@@ -0,0 +1,64 @@
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <stdint.h>
+
+/*
+ * Layout of the statistics file (-S), mapped read-only by monitoring
+ * tools such as icbirc-top. All integers are in host byte order.
+ *
+ * The header is written once, the pid at the first update. The global
+ * block and each session slot are updated under their own sequence
+ * counter: the writer makes seq odd, updates the block, then makes it
+ * even again. A reader copies the block between two reads of seq and
+ * retries if they differ or are odd.
+ */
+
+#define SHM_MAGIC	0x49434253	/* "ICBS" */
+#define SHM_VERSION	1
+#define SHM_SLOTS	16		/* session id modulo SHM_SLOTS */
+#define SHM_NAME	32
+
+struct shm_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	size;		/* of the whole file */
+	uint32_t	slots;
+	int64_t		pid;
+	int64_t		started;	/* time(3) */
+};
+
+struct shm_global {
+	uint32_t	seq;
+	uint32_t	pad;
+	int64_t		updated;	/* time(3) */
+	uint64_t	sessions_active;
+	uint64_t	conn_accepted;
+	uint64_t	conn_rejected;
+	uint64_t	bytes[4];	/* icb_in, icb_out, irc_in, irc_out */
+	uint64_t	packets[4];
+};
+
+struct shm_slot {
+	uint32_t	seq;
+	uint32_t	id;		/* session id, 0 if never used */
+	uint32_t	active;
+	uint32_t	pad;
+	int64_t		started;
+	int64_t		last_read;
+	uint64_t	bytes[4];
+	uint64_t	packets[4];
+	char		nick[SHM_NAME];
+	char		group[SHM_NAME];
+};
+
+struct shm_file {
+	struct shm_header	header;
+	struct shm_global	global;
+	struct shm_slot		slot[SHM_SLOTS];
+};
+
+int	 shm_open_file(const char *);
+void	 shm_update(void);
+
+#endif
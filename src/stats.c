@@ -0,0 +1,991 @@
+/*
+ * Copyright (c) 2023-2024 Laurent Cheylus <foxy@free.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <bsd/string.h>
+#include "hitters.h"
+#include "irc.h"
+#include "log.h"
+#include "mem.h"
+#include "prof.h"
+#include "stats.h"
+
+/*
+ * Counters are plain globals updated in place by the protocol code.
+ * The optional metrics listener (-m) speaks just enough HTTP to serve
+ * them in Prometheus text format:
+ *
+ *   GET /metrics   all counters, gauges and histograms
+ *   GET /health    always 200, the process is alive
+ *   GET /ready     200 when no session is in progress, 503 otherwise
+ *
+ * Only one client session is proxied at a time, new IRC connections
+ * wait in the listen queue until it ends, hence /ready.
+ *
+ * Metrics connections are served from the same select() loops as the
+ * proxy and never block: requests are read and responses written only
+ * when the socket is ready.
+ */
+
+#define STATS_MAX_CLIENTS	8
+#define STATS_MAX_REQUEST	1024
+
+struct stats stats;
+uint64_t stats_slow_usec = 0;	/* log messages slower than this, 0 = off */
+
+/* message being forwarded, see trace_begin() */
+static struct {
+	int		 fwd;		/* -1 when idle */
+	uint64_t	 read;		/* time of the last read(2) */
+	uint64_t	 start;
+	uint64_t	 written;	/* time of the last write to the peer */
+} trace = { -1, 0, 0, 0 };
+
+static struct stats_client {
+	int	 fd;
+	char	 in[STATS_MAX_REQUEST];
+	size_t	 inlen;
+	char	*out;
+	size_t	 outlen, outoff;
+} stats_clients[STATS_MAX_CLIENTS];
+
+static int stats_listen_fd = -1;
+struct session session = { 0, -1, -1 };
+
+#define TCP_SAMPLE_USEC	1000000		/* TCP_INFO sampling interval */
+static uint64_t tcp_sampled;
+
+static const char *dir_names[dir_max] = { "icb_in", "icb_out", "irc_in",
+    "irc_out" };
+static const char *fwd_names[fwd_max] = { "icb_to_irc", "irc_to_icb" };
+static const char *phase_names[phase_max] = { "accept", "connect",
+    "protocol", "register", "login", "login_ok", "welcome" };
+
+/* setup of the current session, time each step was reached and took */
+static uint64_t phase_mark[phase_max];
+static uint64_t phase_usec[phase_max];
+
+static int	 tcp_sample(int, struct tcp_sample *);
+static unsigned	 hist_index(uint64_t);
+static uint64_t	 hist_lower(unsigned);
+static void	 stats_hist(struct buf *, const char *, const char *,
+		    const struct histogram *);
+static void	 stats_prof(const char *, const char *,
+		    const struct prof_counter *, void *);
+static void	 stats_render_tcp(struct buf *);
+static void	 stats_render_hitters(struct buf *);
+static void	 stats_render_mem(struct buf *);
+static int	 stats_path(const char *, const char *);
+static void	 stats_request(struct stats_client *);
+static void	 stats_close(struct stats_client *);
+
+uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static unsigned
+hist_index(uint64_t v)
+{
+	unsigned e = HIST_SUB_BITS;
+
+	if (v < HIST_SUB)
+		return (v);
+	if (v >= (1ULL << HIST_MAX_EXP))
+		return (HIST_BUCKETS);
+	while (v >> (e + 1))
+		e++;
+	/* 2^e <= v < 2^(e + 1), keep the HIST_SUB_BITS bits below e */
+	return ((e - HIST_SUB_BITS + 1) * HIST_SUB +
+	    (v >> (e - HIST_SUB_BITS)) - HIST_SUB);
+}
+
+/* smallest value counted in bucket i */
+static uint64_t
+hist_lower(unsigned i)
+{
+	unsigned e;
+
+	if (i < HIST_SUB)
+		return (i);
+	if (i >= HIST_BUCKETS)
+		return (1ULL << HIST_MAX_EXP);
+	e = i / HIST_SUB + HIST_SUB_BITS - 1;
+	return ((uint64_t)(i % HIST_SUB + HIST_SUB) << (e - HIST_SUB_BITS));
+}
+
+void
+hist_add(struct histogram *h, uint64_t usec)
+{
+	h->bucket[hist_index(usec)]++;
+	h->count++;
+	h->sum += usec;
+	if (usec > h->max)
+		h->max = usec;
+}
+
+/* value below which a fraction q of the samples lie, 0 when empty */
+uint64_t
+hist_quantile(const struct histogram *h, double q)
+{
+	uint64_t n = 0, rank;
+	unsigned i;
+
+	if (h->count == 0)
+		return (0);
+	rank = q * h->count;
+	if (rank >= h->count)
+		rank = h->count - 1;
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		if ((n += h->bucket[i]) > rank)
+			break;
+	if (i == HIST_BUCKETS)
+		return (h->max);
+	/* middle of the bucket, capped by the largest sample seen */
+	n = (hist_lower(i) + hist_lower(i + 1)) / 2;
+	return (n < h->max ? n : h->max);
+}
+
+/*
+ * Mark a session setup step as reached, the first time only:
+ *
+ *   accept	client connection accepted (resets the session)
+ *   connect	upstream TCP connection established
+ *   protocol	ICB 'j' protocol packet received
+ *   register	client sent both NICK and USER
+ *   login	icb_send_login() written to the server
+ *   login_ok	ICB 'a' login OK received
+ *   welcome	001-376 burst written to the client
+ *
+ * Each step is timed from the latest earlier step reached before it,
+ * e.g. the client usually registers before the 'j' packet arrives, so
+ * register is then timed from connect and login from protocol.
+ */
+void
+stats_phase(int phase)
+{
+	uint64_t now = stats_now(), prev = 0;
+	int i;
+
+	if (phase == phase_accept) {
+		memset(phase_mark, 0, sizeof(phase_mark));
+		memset(phase_usec, 0, sizeof(phase_usec));
+		phase_mark[phase_accept] = now;
+		return;
+	}
+	if (phase_mark[phase_accept] == 0 || phase_mark[phase])
+		return;
+	for (i = 0; i < phase; ++i)
+		if (phase_mark[i] > prev)
+			prev = phase_mark[i];
+	phase_mark[phase] = now;
+	phase_usec[phase] = now - prev;
+	hist_add(&stats.phase_latency[phase], phase_usec[phase]);
+}
+
+/* "connect 120 protocol 310 ... us" for the session summary, - if not reached */
+void
+stats_phases(char *s, size_t size)
+{
+	size_t off = 0;
+	int i, r;
+
+	s[0] = 0;
+	for (i = phase_accept + 1; i < phase_max && off < size; ++i) {
+		if (phase_mark[i])
+			r = snprintf(s + off, size - off, "%s %llu ",
+			    phase_names[i], (unsigned long long)phase_usec[i]);
+		else
+			r = snprintf(s + off, size - off, "%s - ",
+			    phase_names[i]);
+		if (r < 0)
+			return;
+		off += r;
+	}
+	if (off < size)
+		snprintf(s + off, size - off, "us");
+}
+
+/*
+ * Per-message latency, from the read(2) that completed an ICB packet
+ * or IRC line (trace_read(), then trace_begin() once the message is
+ * complete) until its translation has been written to the other peer
+ * (last stats_write() to that peer before trace_end()). Messages that
+ * produce no output are not counted. type is the ICB command byte or
+ * the index in irc_verbs, for the slow log.
+ */
+void
+trace_read(void)
+{
+	trace.read = stats_now();
+}
+
+void
+trace_begin(int fwd)
+{
+	trace.fwd = fwd;
+	trace.start = trace.read;
+	trace.written = 0;
+}
+
+void
+trace_end(int type)
+{
+	uint64_t usec;
+	int fwd = trace.fwd;
+
+	trace.fwd = -1;
+	if (fwd < 0 || trace.written == 0)
+		return;
+	usec = trace.written - trace.start;
+	hist_add(&stats.forward_latency[fwd], usec);
+	if (stats_slow_usec == 0 || usec < stats_slow_usec)
+		return;
+	stats.slow[fwd]++;
+	if (fwd == fwd_icb_to_irc)
+		log_msg(LOG_NOTICE, logk_slow, "slow ICB packet '%c' to IRC: "
+		    "%llu us", type >= 'a' && type <= 'z' ? type : '?',
+		    (unsigned long long)usec);
+	else {
+		const char *verb = "other";
+		int n;
+
+		for (n = 0; irc_verbs[n] != NULL; ++n)
+			if (n == type) {
+				verb = irc_verbs[n];
+				break;
+			}
+		log_msg(LOG_NOTICE, logk_slow, "slow IRC %s to ICB: %llu us",
+		    verb, (unsigned long long)usec);
+	}
+}
+
+void
+stats_session(int client_fd, int server_fd)
+{
+	if (client_fd != session.client_fd)
+		memset(&stats.tcp[peer_irc], 0, sizeof(stats.tcp[peer_irc]));
+	if (server_fd != session.server_fd)
+		memset(&stats.tcp[peer_icb], 0, sizeof(stats.tcp[peer_icb]));
+	if (client_fd >= 0 && session.client_fd < 0) {
+		session.id++;
+		session.start = session.last_read = time(NULL);
+		memset(session.bytes, 0, sizeof(session.bytes));
+		memcpy(session.packets_base, stats.packets,
+		    sizeof(session.packets_base));
+		mem_static(mem_session, &session, sizeof(session));
+		mem_static(mem_stats, &stats, sizeof(stats));
+	}
+	session.client_fd = client_fd;
+	session.server_fd = server_fd;
+	stats.sessions_active = client_fd >= 0;
+	tcp_sampled = 0;
+}
+
+/* read the kernel's view of a connection, non-zero if unavailable */
+static int
+tcp_sample(int fd, struct tcp_sample *s)
+{
+#if defined(TCP_INFO) && (defined(__linux__) || defined(__FreeBSD__))
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	if (fd < 0 || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len))
+		return (1);
+	s->rtt = ti.tcpi_rtt;
+	s->rttvar = ti.tcpi_rttvar;
+#ifdef __linux__
+	s->retrans = ti.tcpi_total_retrans;
+	s->unacked = ti.tcpi_unacked;
+#else
+	s->retrans = ti.tcpi_snd_rexmitpack;
+	s->unacked = 0;
+#endif
+	s->sndq = stats_outq(fd);
+	return (0);
+#else
+	return (1);
+#endif
+}
+
+/*
+ * Sample TCP_INFO on both connections of the session, at most once per
+ * TCP_SAMPLE_USEC. Called from the session loop and before rendering
+ * the metrics; every sampled RTT also goes to a histogram, and
+ * retransmissions are summed over all sessions.
+ */
+void
+stats_tcpinfo(void)
+{
+	int fd[peer_max], i;
+	uint64_t now = stats_now();
+	struct tcp_sample s;
+
+	if (now - tcp_sampled < TCP_SAMPLE_USEC)
+		return;
+	tcp_sampled = now;
+	fd[peer_irc] = session.client_fd;
+	fd[peer_icb] = session.server_fd;
+	for (i = 0; i < peer_max; ++i) {
+		if (tcp_sample(fd[i], &s))
+			continue;
+		if (stats.tcp[i].valid && s.retrans > stats.tcp[i].retrans)
+			stats.tcp_retrans[i] += s.retrans - stats.tcp[i].retrans;
+		else if (!stats.tcp[i].valid)
+			stats.tcp_retrans[i] += s.retrans;
+		s.valid = 1;
+		stats.tcp[i] = s;
+		hist_add(&stats.tcp_rtt[i], s.rtt);
+	}
+}
+
+/* account for len bytes read from one of the session's peers */
+void
+stats_read(int fd, int len)
+{
+	int dir;
+
+	if (fd == session.server_fd)
+		dir = dir_icb_in;
+	else if (fd == session.client_fd)
+		dir = dir_irc_in;
+	else
+		return;
+	stats.bytes[dir] += len;
+	session.bytes[dir] += len;
+	session.last_read = time(NULL);
+}
+
+/* account for len bytes written to one of the session's peers */
+void
+stats_write(int fd, int len)
+{
+	int dir;
+
+	if (fd == session.server_fd)
+		dir = dir_icb_out;
+	else if (fd == session.client_fd)
+		dir = dir_irc_out;
+	else
+		return;
+	stats.bytes[dir] += len;
+	stats.packets[dir]++;
+	session.bytes[dir] += len;
+	if ((trace.fwd == fwd_icb_to_irc && dir == dir_irc_out) ||
+	    (trace.fwd == fwd_irc_to_icb && dir == dir_icb_out))
+		trace.written = stats_now();
+}
+
+/*
+ * Open the metrics listener. addr is either the path of a UNIX socket
+ * (anything containing a '/') or [address:]port for TCP.
+ */
+int
+stats_listen(const char *addr)
+{
+	int fd, val = 1;
+
+	if (strchr(addr, '/') != NULL) {
+		struct sockaddr_un sun;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlcpy(sun.sun_path, addr, sizeof(sun.sun_path)) >=
+		    sizeof(sun.sun_path)) {
+			fprintf(stderr, "metrics: path too long: %s\n", addr);
+			return (1);
+		}
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+			perror("socket");
+			return (1);
+		}
+		unlink(addr);
+		if (bind(fd, (const struct sockaddr *)&sun, sizeof(sun))) {
+			fprintf(stderr, "bind %s: %s\n", addr,
+			    strerror(errno));
+			close(fd);
+			return (1);
+		}
+	} else {
+		struct sockaddr_in sa;
+		char host[256];
+		const char *port;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if ((port = strrchr(addr, ':')) != NULL) {
+			strlcpy(host, addr, sizeof(host));
+			host[port - addr] = 0;
+			sa.sin_addr.s_addr = inet_addr(host);
+			port++;
+		} else
+			port = addr;
+		sa.sin_port = htons(atoi(port));
+		if (sa.sin_addr.s_addr == INADDR_NONE || !sa.sin_port) {
+			fprintf(stderr, "metrics: invalid address: %s\n",
+			    addr);
+			return (1);
+		}
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+			perror("socket");
+			return (1);
+		}
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+		    (const char *)&val, sizeof(val))) {
+			perror("setsockopt");
+			close(fd);
+			return (1);
+		}
+		if (bind(fd, (const struct sockaddr *)&sa, sizeof(sa))) {
+			fprintf(stderr, "bind %s:%u: %s\n",
+			    inet_ntoa(sa.sin_addr), ntohs(sa.sin_port),
+			    strerror(errno));
+			close(fd);
+			return (1);
+		}
+	}
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) ||
+	    listen(fd, STATS_MAX_CLIENTS)) {
+		perror("listen");
+		close(fd);
+		return (1);
+	}
+	stats_listen_fd = fd;
+	mem_static(mem_input, stats_clients, sizeof(stats_clients));
+	return (0);
+}
+
+/*
+ * Add the metrics listener and connections to the sets passed to
+ * select(), return the new maximum fd.
+ */
+int
+stats_fdset(fd_set *readfds, fd_set *writefds, int max_fd)
+{
+	int i;
+
+	if (stats_listen_fd < 0)
+		return (max_fd);
+	FD_SET(stats_listen_fd, readfds);
+	if (stats_listen_fd > max_fd)
+		max_fd = stats_listen_fd;
+	for (i = 0; i < STATS_MAX_CLIENTS; ++i) {
+		struct stats_client *c = &stats_clients[i];
+
+		if (c->fd <= 0)
+			continue;
+		if (c->out != NULL)
+			FD_SET(c->fd, writefds);
+		else
+			FD_SET(c->fd, readfds);
+		if (c->fd > max_fd)
+			max_fd = c->fd;
+	}
+	return (max_fd);
+}
+
+void
+stats_process(fd_set *readfds, fd_set *writefds)
+{
+	int i;
+
+	if (stats_listen_fd < 0)
+		return;
+	for (i = 0; i < STATS_MAX_CLIENTS; ++i) {
+		struct stats_client *c = &stats_clients[i];
+		ssize_t len;
+
+		if (c->fd <= 0)
+			continue;
+		if (c->out != NULL && FD_ISSET(c->fd, writefds)) {
+			len = write(c->fd, c->out + c->outoff,
+			    c->outlen - c->outoff);
+			if (len < 0 && errno != EINTR && errno != EAGAIN)
+				stats_close(c);
+			else if (len > 0 && (c->outoff += len) == c->outlen)
+				stats_close(c);
+		} else if (c->out == NULL && FD_ISSET(c->fd, readfds)) {
+			len = read(c->fd, c->in + c->inlen,
+			    sizeof(c->in) - 1 - c->inlen);
+			if (len <= 0) {
+				if (len == 0 || (errno != EINTR &&
+				    errno != EAGAIN))
+					stats_close(c);
+				continue;
+			}
+			c->inlen += len;
+			c->in[c->inlen] = 0;
+			if (strstr(c->in, "\r\n\r\n") != NULL ||
+			    strstr(c->in, "\n\n") != NULL ||
+			    c->inlen == sizeof(c->in) - 1)
+				stats_request(c);
+		}
+	}
+	if (FD_ISSET(stats_listen_fd, readfds)) {
+		int fd;
+
+		if ((fd = accept(stats_listen_fd, NULL, NULL)) < 0)
+			return;
+		for (i = 0; i < STATS_MAX_CLIENTS; ++i)
+			if (stats_clients[i].fd <= 0)
+				break;
+		if (i == STATS_MAX_CLIENTS ||
+		    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+			close(fd);
+			return;
+		}
+		memset(&stats_clients[i], 0, sizeof(stats_clients[i]));
+		stats_clients[i].fd = fd;
+	}
+}
+
+static void
+stats_close(struct stats_client *c)
+{
+	close(c->fd);
+	mem_free(mem_output, c->out);
+	memset(c, 0, sizeof(*c));
+}
+
+/* request line in is a GET of path, whatever the query string */
+static int
+stats_path(const char *in, const char *path)
+{
+	size_t len = strlen(path);
+
+	if (strncmp(in, "GET ", 4) || strncmp(in + 4, path, len))
+		return (0);
+	in += 4 + len;
+	return (*in == ' ' || *in == '?' || *in == '\r' || *in == '\n' ||
+	    *in == 0);
+}
+
+static void
+stats_request(struct stats_client *c)
+{
+	struct buf body = { NULL, 0, 0 }, resp = { NULL, 0, 0 };
+	const char *status = "200 OK";
+
+	if (stats_path(c->in, "/metrics"))
+		stats_render(&body);
+	else if (stats_path(c->in, "/health"))
+		bprintf(&body, "ok\n");
+	else if (stats_path(c->in, "/ready")) {
+		if (stats.sessions_active) {
+			status = "503 Service Unavailable";
+			bprintf(&body, "busy\n");
+		} else
+			bprintf(&body, "ok\n");
+	} else {
+		status = "404 Not Found";
+		bprintf(&body, "not found\n");
+	}
+
+	bprintf(&resp, "HTTP/1.0 %s\r\nContent-Type: text/plain; "
+	    "version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n"
+	    "\r\n%s", status, body.len, body.p != NULL ? body.p : "");
+	mem_free(mem_output, body.p);
+	if (resp.p == NULL) {
+		stats_close(c);
+		return;
+	}
+	c->out = resp.p;
+	c->outlen = resp.len;
+	c->outoff = 0;
+}
+
+void
+bprintf(struct buf *b, const char *format, ...)
+{
+	va_list ap;
+	char *p;
+	int len;
+
+	for (;;) {
+		va_start(ap, format);
+		len = vsnprintf(b->p + b->len, b->siz - b->len, format, ap);
+		va_end(ap);
+		if (len < 0)
+			return;
+		if (b->len + len < b->siz) {
+			b->len += len;
+			return;
+		}
+		if ((p = mem_realloc(mem_output, b->p,
+		    b->siz * 2 + len + 1024)) == NULL) {
+			b->failed = 1;
+			return;
+		}
+		b->p = p;
+		b->siz = b->siz * 2 + len + 1024;
+	}
+}
+
+/*
+ * Prometheus buckets at powers of two, aggregated from the HDR buckets.
+ * A power of two always starts an HDR bucket, so the buckets below it
+ * hold exactly the values up to 2^e - 1, the inclusive le.
+ */
+static void
+stats_hist(struct buf *b, const char *name, const char *label,
+    const struct histogram *h)
+{
+	uint64_t cum = 0;
+	unsigned i = 0, e;
+
+	for (e = 0; e <= HIST_MAX_EXP; ++e) {
+		for (; i < hist_index(1ULL << e); ++i)
+			cum += h->bucket[i];
+		bprintf(b, "%s_bucket{%s%sle=\"%.6f\"} %llu\n", name,
+		    label, *label ? "," : "", (double)((1ULL << e) - 1) / 1e6,
+		    (unsigned long long)cum);
+	}
+	bprintf(b, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label,
+	    *label ? "," : "", (unsigned long long)h->count);
+	bprintf(b, "%s_sum%s%s%s %.6f\n", name, *label ? "{" : "", label,
+	    *label ? "}" : "", h->sum / 1e6);
+	bprintf(b, "%s_count%s%s%s %llu\n", name, *label ? "{" : "", label,
+	    *label ? "}" : "", (unsigned long long)h->count);
+}
+
+/* bytes written to fd but not yet sent by the kernel, -1 if unknown */
+long
+stats_outq(int fd)
+{
+	int n = -1;
+
+	if (fd < 0)
+		return (-1);
+#if defined(FIONWRITE)
+	if (ioctl(fd, FIONWRITE, &n))
+		return (-1);
+#elif defined(__linux__) && defined(TIOCOUTQ)
+	if (ioctl(fd, TIOCOUTQ, &n))
+		return (-1);
+#endif
+	return (n);
+}
+
+/* one family of per-operation counters, see stats_render() */
+struct stats_prof_arg {
+	struct buf	*b;
+	const char	*name;
+	size_t		 field;		/* offset in struct prof_counter */
+};
+
+static void
+stats_prof(const char *kind, const char *op, const struct prof_counter *c,
+    void *arg)
+{
+	struct stats_prof_arg *a = arg;
+
+	bprintf(a->b, "%s{kind=\"%s\",op=\"%s\"} %llu\n", a->name, kind, op,
+	    (unsigned long long)*(const uint64_t *)((const char *)c +
+	    a->field));
+}
+
+/* TCP_INFO samples: current session gauges, then totals over all sessions */
+static void
+stats_render_tcp(struct buf *b)
+{
+	static const char *peers[peer_max] = { "irc", "icb" };
+	static const struct {
+		const char	*name, *help;
+		size_t		 off;
+		double		 scale;
+	} g[] = {
+		{ "icbirc_tcp_rtt_seconds", "Smoothed round trip time",
+		    offsetof(struct tcp_sample, rtt), 1e6 },
+		{ "icbirc_tcp_rttvar_seconds", "Round trip time variance",
+		    offsetof(struct tcp_sample, rttvar), 1e6 },
+		{ "icbirc_tcp_unacked_segments", "Segments sent but not "
+		    "acknowledged", offsetof(struct tcp_sample, unacked), 1 },
+	};
+	char label[32];
+	unsigned i, j;
+
+	stats_tcpinfo();
+	for (j = 0; j < sizeof(g) / sizeof(g[0]); ++j) {
+		bprintf(b, "# HELP %s %s, last sample of the current session."
+		    "\n# TYPE %s gauge\n", g[j].name, g[j].help, g[j].name);
+		for (i = 0; i < peer_max; ++i)
+			if (stats.tcp[i].valid)
+				bprintf(b, "%s{peer=\"%s\"} %g\n", g[j].name,
+				    peers[i], *(uint32_t *)((char *)&stats.tcp[i] +
+				    g[j].off) / g[j].scale);
+	}
+	bprintf(b, "# HELP icbirc_tcp_send_queue_bytes Send queue at the last "
+	    "sample of the current session.\n# TYPE "
+	    "icbirc_tcp_send_queue_bytes gauge\n");
+	for (i = 0; i < peer_max; ++i)
+		if (stats.tcp[i].valid && stats.tcp[i].sndq >= 0)
+			bprintf(b, "icbirc_tcp_send_queue_bytes{peer=\"%s\"} "
+			    "%ld\n", peers[i], stats.tcp[i].sndq);
+	bprintf(b, "# HELP icbirc_tcp_retransmits_total Retransmitted "
+	    "segments.\n# TYPE icbirc_tcp_retransmits_total counter\n");
+	for (i = 0; i < peer_max; ++i)
+		bprintf(b, "icbirc_tcp_retransmits_total{peer=\"%s\"} %llu\n",
+		    peers[i], (unsigned long long)stats.tcp_retrans[i]);
+	bprintf(b, "# HELP icbirc_tcp_rtt_sample_seconds Sampled round trip "
+	    "times.\n# TYPE icbirc_tcp_rtt_sample_seconds histogram\n");
+	for (i = 0; i < peer_max; ++i) {
+		snprintf(label, sizeof(label), "peer=\"%s\"", peers[i]);
+		stats_hist(b, "icbirc_tcp_rtt_sample_seconds", label,
+		    &stats.tcp_rtt[i]);
+	}
+}
+
+void
+stats_render(struct buf *b)
+{
+	char label[64];
+	long q;
+	int i;
+
+	bprintf(b, "# HELP icbirc_sessions_active Client sessions in "
+	    "progress.\n# TYPE icbirc_sessions_active gauge\n"
+	    "icbirc_sessions_active %llu\n",
+	    (unsigned long long)stats.sessions_active);
+
+	bprintf(b, "# HELP icbirc_connections_total Client connections by "
+	    "result.\n# TYPE icbirc_connections_total counter\n");
+	bprintf(b, "icbirc_connections_total{result=\"accepted\"} %llu\n",
+	    (unsigned long long)stats.conn_accepted);
+	bprintf(b, "icbirc_connections_total{result=\"rejected\"} %llu\n",
+	    (unsigned long long)stats.conn_rejected);
+
+	bprintf(b, "# HELP icbirc_bytes_total Bytes read from (in) and "
+	    "written to (out) each peer.\n# TYPE icbirc_bytes_total "
+	    "counter\n");
+	for (i = 0; i < dir_max; ++i)
+		bprintf(b, "icbirc_bytes_total{direction=\"%s\"} %llu\n",
+		    dir_names[i], (unsigned long long)stats.bytes[i]);
+	bprintf(b, "# HELP icbirc_packets_total ICB packets and IRC lines "
+	    "read from (in) and written to (out) each peer.\n"
+	    "# TYPE icbirc_packets_total counter\n");
+	for (i = 0; i < dir_max; ++i)
+		bprintf(b, "icbirc_packets_total{direction=\"%s\"} %llu\n",
+		    dir_names[i], (unsigned long long)stats.packets[i]);
+
+	bprintf(b, "# HELP icbirc_icb_packets_total ICB packets received "
+	    "by command byte.\n# TYPE icbirc_icb_packets_total counter\n");
+	for (i = 0; i < 256; ++i) {
+		if (stats.icb_cmd[i] == 0)
+			continue;
+		if (i >= 'a' && i <= 'z')
+			bprintf(b, "icbirc_icb_packets_total{cmd=\"%c\"} %llu\n",
+			    i, (unsigned long long)stats.icb_cmd[i]);
+		else
+			bprintf(b, "icbirc_icb_packets_total{cmd=\"0x%02x\"} "
+			    "%llu\n", i, (unsigned long long)stats.icb_cmd[i]);
+	}
+	bprintf(b, "# HELP icbirc_irc_commands_total IRC commands received "
+	    "by verb.\n# TYPE icbirc_irc_commands_total counter\n");
+	for (i = 0; irc_verbs[i] != NULL; ++i)
+		bprintf(b, "icbirc_irc_commands_total{verb=\"%s\"} %llu\n",
+		    irc_verbs[i], (unsigned long long)stats.irc_verb[i]);
+	bprintf(b, "icbirc_irc_commands_total{verb=\"other\"} %llu\n",
+	    (unsigned long long)stats.irc_verb[i]);
+
+	bprintf(b, "# HELP icbirc_output_queue_bytes Bytes queued in the "
+	    "kernel towards each peer.\n# TYPE icbirc_output_queue_bytes "
+	    "gauge\n");
+	if ((q = stats_outq(session.client_fd)) >= 0)
+		bprintf(b, "icbirc_output_queue_bytes{peer=\"irc\"} %ld\n", q);
+	if ((q = stats_outq(session.server_fd)) >= 0)
+		bprintf(b, "icbirc_output_queue_bytes{peer=\"icb\"} %ld\n", q);
+
+	stats_render_tcp(b);
+
+	bprintf(b, "# HELP icbirc_upstream_connect_seconds Time to connect "
+	    "to the ICB server.\n# TYPE icbirc_upstream_connect_seconds "
+	    "histogram\n");
+	stats_hist(b, "icbirc_upstream_connect_seconds", "",
+	    &stats.connect_latency);
+	bprintf(b, "# HELP icbirc_session_setup_seconds Time of each session "
+	    "setup step since the previous one.\n# TYPE "
+	    "icbirc_session_setup_seconds histogram\n");
+	for (i = phase_accept + 1; i < phase_max; ++i) {
+		snprintf(label, sizeof(label), "phase=\"%s\"", phase_names[i]);
+		stats_hist(b, "icbirc_session_setup_seconds", label,
+		    &stats.phase_latency[i]);
+	}
+	bprintf(b, "# HELP icbirc_forward_seconds Time from receiving a "
+	    "message to writing its translation.\n# TYPE "
+	    "icbirc_forward_seconds histogram\n");
+	for (i = 0; i < fwd_max; ++i) {
+		snprintf(label, sizeof(label), "direction=\"%s\"",
+		    fwd_names[i]);
+		stats_hist(b, "icbirc_forward_seconds", label,
+		    &stats.forward_latency[i]);
+	}
+	bprintf(b, "# HELP icbirc_forward_quantile_seconds Quantiles of "
+	    "icbirc_forward_seconds.\n# TYPE icbirc_forward_quantile_seconds "
+	    "gauge\n");
+	for (i = 0; i < fwd_max; ++i) {
+		static const double q[] = { 0.5, 0.9, 0.99, 0.999 };
+		unsigned j;
+
+		for (j = 0; j < sizeof(q) / sizeof(q[0]); ++j)
+			bprintf(b, "icbirc_forward_quantile_seconds{direction="
+			    "\"%s\",quantile=\"%g\"} %.6f\n", fwd_names[i],
+			    q[j], hist_quantile(&stats.forward_latency[i],
+			    q[j]) / 1e6);
+	}
+	bprintf(b, "# HELP icbirc_forward_slow_total Messages slower than "
+	    "the slow log threshold.\n# TYPE icbirc_forward_slow_total "
+	    "counter\n");
+	for (i = 0; i < fwd_max; ++i)
+		bprintf(b, "icbirc_forward_slow_total{direction=\"%s\"} "
+		    "%llu\n", fwd_names[i], (unsigned long long)stats.slow[i]);
+
+	bprintf(b, "# HELP icbirc_write_syscalls_total write(2) calls to "
+	    "peers.\n# TYPE icbirc_write_syscalls_total counter\n"
+	    "icbirc_write_syscalls_total %llu\n",
+	    (unsigned long long)prof_writes);
+	bprintf(b, "# HELP icbirc_accounting_enabled Per-operation "
+	    "accounting switched on (SIGUSR2).\n"
+	    "# TYPE icbirc_accounting_enabled gauge\n"
+	    "icbirc_accounting_enabled %d\n", prof_enabled);
+	for (i = 0; i < 4; ++i) {
+		static const struct {
+			const char	*name, *help;
+			size_t		 field;
+		} f[4] = {
+			{ "icbirc_op_calls_total", "Calls",
+			    offsetof(struct prof_counter, calls) },
+			{ "icbirc_op_cycles_total", "CPU cycles",
+			    offsetof(struct prof_counter, cycles) },
+			{ "icbirc_op_writes_total", "write(2) calls",
+			    offsetof(struct prof_counter, writes) },
+			{ "icbirc_op_write_bytes_total", "Bytes written",
+			    offsetof(struct prof_counter, bytes) },
+		};
+		struct stats_prof_arg a = { b, f[i].name, f[i].field };
+
+		bprintf(b, "# HELP %s %s per protocol operation.\n"
+		    "# TYPE %s counter\n", f[i].name, f[i].help, f[i].name);
+		prof_foreach(stats_prof, &a);
+	}
+
+	bprintf(b, "# HELP icbirc_event_subscribers Subscribers of the chat "
+	    "event export.\n# TYPE icbirc_event_subscribers gauge\n"
+	    "icbirc_event_subscribers %llu\n",
+	    (unsigned long long)stats.event_subscribers);
+	bprintf(b, "# HELP icbirc_events_total Chat events exported.\n"
+	    "# TYPE icbirc_events_total counter\nicbirc_events_total %llu\n",
+	    (unsigned long long)stats.events);
+	bprintf(b, "# HELP icbirc_events_dropped_total Chat events not "
+	    "queued to a subscriber, its queue being full.\n"
+	    "# TYPE icbirc_events_dropped_total counter\n"
+	    "icbirc_events_dropped_total %llu\n",
+	    (unsigned long long)stats.events_dropped);
+
+	stats_render_hitters(b);
+	stats_render_mem(b);
+}
+
+/* heavy hitters, the name is the nick or group as a label value */
+static void
+stats_render_hitters(struct buf *b)
+{
+	const char *keys[HH_TOP];
+	unsigned counts[HH_TOP];
+	char name[2 * 32 + 1], *p;
+	const char *k;
+	int dim, i, n;
+
+	bprintf(b, "# HELP icbirc_top_messages Messages in the last %d "
+	    "seconds of the busiest nicks and groups (estimated).\n"
+	    "# TYPE icbirc_top_messages gauge\n", HH_SLOTS * HH_SLOT_SECS);
+	for (dim = 0; dim < hh_max; ++dim) {
+		n = hh_top(dim, keys, counts, HH_TOP);
+		for (i = 0; i < n; ++i) {
+			for (k = keys[i], p = name; *k &&
+			    p < name + sizeof(name) - 2; ++k) {
+				if (*k == '"' || *k == '\\')
+					*p++ = '\\';
+				*p++ = *k == '\n' ? ' ' : *k;
+			}
+			*p = 0;
+			bprintf(b, "icbirc_top_messages{kind=\"%s\",rank=\"%d\","
+			    "name=\"%s\"} %u\n", hh_names[dim], i + 1, name,
+			    counts[i]);
+		}
+	}
+}
+
+static void
+stats_render_mem(struct buf *b)
+{
+	int i;
+
+	bprintf(b, "# HELP icbirc_memory_bytes Memory in use by subsystem, "
+	    "heap allocations and static buffers.\n"
+	    "# TYPE icbirc_memory_bytes gauge\n");
+	for (i = 0; i < mem_max; ++i)
+		bprintf(b, "icbirc_memory_bytes{subsystem=\"%s\","
+		    "type=\"heap\"} %llu\n"
+		    "icbirc_memory_bytes{subsystem=\"%s\","
+		    "type=\"static\"} %llu\n",
+		    mem_names[i], (unsigned long long)mem_usage[i].heap,
+		    mem_names[i], (unsigned long long)mem_usage[i].fixed);
+	bprintf(b, "# HELP icbirc_memory_allocations Live heap allocations by "
+	    "subsystem.\n# TYPE icbirc_memory_allocations gauge\n");
+	for (i = 0; i < mem_max; ++i)
+		bprintf(b, "icbirc_memory_allocations{subsystem=\"%s\"} %llu\n",
+		    mem_names[i], (unsigned long long)mem_usage[i].blocks);
+	bprintf(b, "# HELP icbirc_memory_allocations_total Heap allocations "
+	    "by subsystem.\n# TYPE icbirc_memory_allocations_total counter\n");
+	for (i = 0; i < mem_max; ++i)
+		bprintf(b, "icbirc_memory_allocations_total{subsystem=\"%s\"} "
+		    "%llu\n", mem_names[i],
+		    (unsigned long long)mem_usage[i].allocs);
+}
@@ -0,0 +1,109 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <sys/types.h>
+#include <sys/select.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Latency histograms in microseconds, HDR style: values below HIST_SUB
+ * are counted exactly, above that each power of two is split into
+ * HIST_SUB linear sub-buckets (relative error below 1/HIST_SUB).
+ * Values of 2^HIST_MAX_EXP and more go to the last bucket.
+ */
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP	26
+#define HIST_BUCKETS	((HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+	uint64_t	count;
+	uint64_t	sum;		/* microseconds */
+	uint64_t	max;
+	uint64_t	bucket[HIST_BUCKETS + 1];	/* last is overflow */
+};
+
+enum { dir_icb_in, dir_icb_out, dir_irc_in, dir_irc_out, dir_max };
+enum { fwd_icb_to_irc, fwd_irc_to_icb, fwd_max };
+
+enum { peer_irc, peer_icb, peer_max };
+
+/* last TCP_INFO sample of a peer connection, times in microseconds */
+struct tcp_sample {
+	int		valid;
+	uint32_t	rtt;
+	uint32_t	rttvar;
+	uint32_t	retrans;	/* total retransmitted segments */
+	uint32_t	unacked;	/* segments */
+	long		sndq;		/* bytes, -1 if unknown */
+};
+
+/* session setup steps, in their usual order, see stats_phase() */
+enum { phase_accept, phase_connect, phase_protocol, phase_register,
+    phase_login, phase_login_ok, phase_welcome, phase_max };
+
+struct stats {
+	uint64_t	sessions_active;
+	uint64_t	conn_accepted;
+	uint64_t	conn_rejected;
+	uint64_t	bytes[dir_max];
+	uint64_t	packets[dir_max];
+	uint64_t	icb_cmd[256];
+	uint64_t	irc_verb[32];
+	struct histogram connect_latency;
+	struct histogram forward_latency[fwd_max];
+	uint64_t	slow[fwd_max];
+	struct histogram phase_latency[phase_max];	/* accept unused */
+	struct tcp_sample tcp[peer_max];	/* current session */
+	struct histogram tcp_rtt[peer_max];	/* all samples */
+	uint64_t	tcp_retrans[peer_max];
+	uint64_t	events;			/* exported, see events.c */
+	uint64_t	events_dropped;
+	uint64_t	event_subscribers;
+};
+
+/* the session being proxied, fds are -1 when there is none */
+struct session {
+	unsigned	id;		/* sequence number */
+	int		client_fd;
+	int		server_fd;
+	time_t		start;
+	time_t		last_read;
+	uint64_t	bytes[dir_max];
+	uint64_t	packets_base[dir_max];	/* stats.packets at start */
+};
+
+/* growing text buffer */
+struct buf {
+	char	*p;
+	size_t	 len, siz;
+	int	 failed;	/* an output did not fit and was lost */
+};
+
+extern struct stats stats;
+extern struct session session;
+extern uint64_t stats_slow_usec;
+
+int		 stats_listen(const char *);
+int		 stats_fdset(fd_set *, fd_set *, int);
+void		 stats_process(fd_set *, fd_set *);
+void		 stats_session(int, int);
+void		 stats_read(int, int);
+void		 stats_write(int, int);
+long		 stats_outq(int);
+void		 stats_tcpinfo(void);
+void		 stats_render(struct buf *);
+uint64_t	 stats_now(void);
+void		 hist_add(struct histogram *, uint64_t);
+uint64_t	 hist_quantile(const struct histogram *, double);
+void		 stats_phase(int);
+void		 stats_phases(char *, size_t);
+void		 trace_read(void);
+void		 trace_begin(int);
+void		 trace_end(int);
+
+void		 bprintf(struct buf *, const char *, ...)
+		    __attribute__((format(printf, 2, 3)));
+
+#endif
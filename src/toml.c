@@ -26,14 +26,32 @@
 */
 #define _POSIX_C_SOURCE 200809L
 #include "toml.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+/* Vector fast paths for the tokenizer and the UTF-8 validator on x86:
+ * the loops of toml_vec.h are built for SSE2, which x86-64 always has,
+ * and with target attributes for SSSE3 (the validator, which needs a
+ * byte shuffle) and AVX2, the ones to use being picked once at startup
+ * by vec_init(). Define TOML_NO_SIMD to build the scalar code only.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) &&        \
+    defined(__GNUC__) && !defined(TOML_NO_SIMD)
+#define VEC_X86
+#include <immintrin.h>
+#endif
 
 static void *(*ppmalloc)(size_t) = malloc;
 static void (*ppfree)(void *) = free;
@@ -45,9 +63,83 @@ void toml_set_memutil(void *(*xxmalloc)(size_t), void (*xxfree)(void *)) {
     ppfree = xxfree;
 }
 
+/* In arena mode (toml_set_arena()), everything toml_parse() allocates
+ * for the tree comes from a list of chunks owned by the root table, and
+ * toml_free() releases the chunks instead of walking the tree. FREE()
+ * does nothing while parsing: the space is reclaimed with the chunks.
+ * The chunks themselves are allocated with ppmalloc. The arena being
+ * filled is per thread, so that threads can parse concurrently.
+ */
+typedef struct toml_chunk_t toml_chunk_t;
+struct toml_chunk_t {
+  toml_chunk_t *next;
+  size_t size; /* bytes of data after the header */
+  size_t used;
+};
+
+#define ARENA_MIN 4096          /* size of the first chunk */
+#define ARENA_MAX (1024 * 1024) /* chunks double up to this size */
+
+static int arena_mode;
+static __thread toml_chunk_t **cur_arena; /* while toml_parse() runs */
+
+void toml_set_arena(int enable) { arena_mode = enable; }
+
 #define ALIGN8(sz) (((sz) + 7) & ~7)
-#define MALLOC(a) ppmalloc(a)
-#define FREE(a) ppfree(a)
+#define CHUNK_DATA(c) ((char *)(c) + ALIGN8(sizeof(toml_chunk_t)))
+#define MALLOC(a) (cur_arena ? arena_alloc(a) : ppmalloc(a))
+#define FREE(a) (cur_arena ? (void)0 : ppfree(a))
+
+static void *arena_alloc(size_t n) {
+  toml_chunk_t *c = *cur_arena;
+
+  n = ALIGN8(n);
+  if (!c || c->size - c->used < n) {
+    size_t size = c ? c->size * 2 : ARENA_MIN;
+    if (size > ARENA_MAX)
+      size = ARENA_MAX;
+    if (size < n)
+      size = n;
+
+    toml_chunk_t *x = ppmalloc(ALIGN8(sizeof(*x)) + size);
+    if (!x)
+      return 0;
+    x->size = size;
+    x->used = n;
+    if (c && n > size / 4) {
+      /* large block: keep filling the current chunk */
+      x->next = c->next;
+      c->next = x;
+      return CHUNK_DATA(x);
+    }
+    x->next = c;
+    x->used = 0;
+    *cur_arena = c = x;
+  }
+
+  void *p = CHUNK_DATA(c) + c->used;
+  c->used += n;
+  return p;
+}
+
+/* Grow the last block allocated from the current chunk in place. */
+static int arena_extend(void *p, size_t sz, size_t newsz) {
+  toml_chunk_t *c = *cur_arena;
+
+  if (!c || (char *)p + ALIGN8(sz) != CHUNK_DATA(c) + c->used ||
+      ALIGN8(newsz) - ALIGN8(sz) > c->size - c->used)
+    return 0;
+  c->used += ALIGN8(newsz) - ALIGN8(sz);
+  return 1;
+}
+
+static void arena_free(toml_chunk_t *c) {
+  while (c) {
+    toml_chunk_t *next = c->next;
+    ppfree(c);
+    c = next;
+  }
+}
 
 #define malloc(x) error - forbidden - use MALLOC instead
 #define free(x) error - forbidden - use FREE instead
@@ -279,10 +371,22 @@ int toml_ucs_to_utf8(int64_t code, char buf[6]) {
  *	TOML has 3 data structures: value, array, table.
  *	Each of them can have identification key.
  */
+/* Content of a string value for the view accessors. ptr points into
+ * the raw value, or to norm, the unescaped copy, if the string had
+ * escapes. ptr is 0 if the value is not a valid string.
+ */
+typedef struct toml_strview_t toml_strview_t;
+struct toml_strview_t {
+  const char *ptr;
+  int len;
+  char *norm;
+};
+
 typedef struct toml_keyval_t toml_keyval_t;
 struct toml_keyval_t {
   const char *key; /* key to this value */
   const char *val; /* the raw value */
+  toml_strview_t sv;
 };
 
 typedef struct toml_arritem_t toml_arritem_t;
@@ -290,10 +394,21 @@ struct toml_arritem_t {
   int valtype; /* for value kind: 'i'nt, 'd'ouble, 'b'ool, 's'tring, 't'ime,
                   'D'ate, 'T'imestamp */
   char *val;
+  toml_strview_t sv;
   toml_array_t *arr;
   toml_table_t *tab;
 };
 
+/* A slot of the hash index of a table: the hash of the key, and the
+ * entry as its kind (0 kval, 1 arr, 2 tab) in the low 2 bits and its
+ * position above, plus 1 so that 0 is a free slot.
+ */
+typedef struct toml_index_t toml_index_t;
+struct toml_index_t {
+  uint32_t hash;
+  uint32_t ref;
+};
+
 struct toml_array_t {
   const char *key; /* key to this array */
   int kind;        /* element kind: 'v'alue, 'a'rray, or 't'able, 'm'ixed */
@@ -320,6 +435,15 @@ struct toml_table_t {
   /* tables in the table */
   int ntab;
   toml_table_t **tab;
+
+  /* hash index of the keys, see table_find() */
+  int nslot;          /* number of slots, a power of 2 */
+  int nindex[3];      /* kval, arr and tab entries in the index */
+  toml_index_t *index;
+
+  toml_chunk_t *arena; /* root table in arena mode: the whole tree */
+  void *image;         /* root table loaded from an image: the mapping */
+  size_t imagesz;
 };
 
 static inline void xfree(const void *x) {
@@ -408,6 +532,9 @@ static int e_forbid(context_t *ctx, int lineno, const char *msg) {
 }
 
 static void *expand(void *p, int sz, int newsz) {
+  if (cur_arena && p && arena_extend(p, sz, newsz))
+    return p;
+
   void *s = MALLOC(newsz);
   if (!s)
     return 0;
@@ -419,23 +546,35 @@ static void *expand(void *p, int sz, int newsz) {
   return s;
 }
 
+/* Make room for element n of an array holding n elements. The capacity
+ * is not stored: it is the smallest power of 2 not below n, so the array
+ * is reallocated to twice its size whenever n is a power of 2.
+ */
+static int grow_at(int n) { return (n & (n - 1)) == 0; }
+
 static void **expand_ptrarr(void **p, int n) {
-  void **s = MALLOC((n + 1) * sizeof(void *));
-  if (!s)
-    return 0;
+  void **s = p;
+  if (grow_at(n)) {
+    if (n > INT_MAX / 2 / (int)sizeof(void *))
+      return 0;
+    s = expand(p, n * sizeof(void *), (n ? 2 * n : 1) * sizeof(void *));
+    if (!s)
+      return 0;
+  }
 
   s[n] = 0;
-  if (p) {
-    memcpy(s, p, n * sizeof(void *));
-    FREE(p);
-  }
   return s;
 }
 
 static toml_arritem_t *expand_arritem(toml_arritem_t *p, int n) {
-  toml_arritem_t *pp = expand(p, n * sizeof(*p), (n + 1) * sizeof(*p));
-  if (!pp)
-    return 0;
+  toml_arritem_t *pp = p;
+  if (grow_at(n)) {
+    if (n > INT_MAX / 2 / (int)sizeof(*p))
+      return 0;
+    pp = expand(p, n * sizeof(*p), (n ? 2 * n : 1) * sizeof(*p));
+    if (!pp)
+      return 0;
+  }
 
   memset(&pp[n], 0, sizeof(pp[n]));
   return pp;
@@ -491,7 +630,7 @@ static char *norm_lit_str(const char *src, int srclen, int multiline,
  * Returns NULL if error with errmsg in errbuf.
  */
 static char *norm_basic_str(const char *src, int srclen, int multiline,
-                            char *errbuf, int errbufsz) {
+                            int *lenp, char *errbuf, int errbufsz) {
   char *dst = 0; /* will write to dst[] and return it */
   int max = 0;   /* max size of dst[] */
   int off = 0;   /* cur offset in dst[] */
@@ -618,10 +757,98 @@ static char *norm_basic_str(const char *src, int srclen, int multiline,
   }
 
   // Cap with NUL and return it.
+  if (lenp)
+    *lenp = off;
   dst[off++] = 0;
   return dst;
 }
 
+/* Find the content of the string value src of srclen chars. Return its
+ * quote char, with *spp pointing to the first char after the quote and
+ * *sqp one char beyond the last valid char, or 0 if src is not a string.
+ */
+static int str_bounds(const char *src, int srclen, const char **spp,
+                      const char **sqp, int *multiline) {
+  const char *sp;
+  const char *sq;
+
+  // for strings, first char must be a s-quote or d-quote
+  int qchar = srclen > 0 ? src[0] : 0;
+  if (!(qchar == '\'' || qchar == '"')) {
+    return 0;
+  }
+
+  // triple quotes?
+  *multiline = 0;
+  if (srclen >= 3 && qchar == src[1] && qchar == src[2]) {
+    *multiline = 1;        // triple-quote implies multiline
+    sp = src + 3;          // first char after quote
+    sq = src + srclen - 3; // first char of ending quote
+
+    if (!(sp <= sq && sq[0] == qchar && sq[1] == qchar && sq[2] == qchar)) {
+      // last 3 chars in src must be qchar
+      return 0;
+    }
+
+    /* skip new line immediate after qchar */
+    if (sp[0] == '\n')
+      sp++;
+    else if (sp[0] == '\r' && sp[1] == '\n')
+      sp += 2;
+
+  } else {
+    sp = src + 1;          // first char after quote
+    sq = src + srclen - 1; // ending quote
+    if (!(sp <= sq && *sq == qchar)) {
+      /* last char in src must be qchar */
+      return 0;
+    }
+  }
+
+  *spp = sp;
+  *sqp = sq;
+  return qchar;
+}
+
+/* Set the view of the string value raw of len chars. Strings without
+ * escapes are seen in place, only those with escapes are unescaped into
+ * a copy. Return -1 if out of memory.
+ */
+static int set_strview(toml_strview_t *sv, const char *raw, int len) {
+  const char *sp, *sq, *p;
+  int multiline;
+  int qchar = str_bounds(raw, len, &sp, &sq, &multiline);
+
+  sv->ptr = 0;
+  if (!qchar)
+    return 0;
+
+  for (p = sp; p < sq; p++) {
+    int ch = *p;
+    if (ch == '\\' && qchar == '"')
+      break;
+    /* same check as norm_lit_str() and norm_basic_str() */
+    if ((0 <= ch && ch <= 0x08) || (0x0a <= ch && ch <= 0x1f) || (ch == 0x7f)) {
+      if (!(multiline && (ch == '\r' || ch == '\n')))
+        return 0;
+    }
+  }
+  if (p == sq) {
+    sv->ptr = sp;
+    sv->len = sq - sp;
+    return 0;
+  }
+
+  char ebuf[80];
+  ebuf[0] = 0;
+  sv->norm = norm_basic_str(sp, sq - sp, multiline, &sv->len, ebuf,
+                            sizeof(ebuf));
+  if (!sv->norm)
+    return strcmp(ebuf, "out of memory") ? 0 : -1;
+  sv->ptr = sv->norm;
+  return 0;
+}
+
 /* Normalize a key. Convert all special chars to raw unescaped utf-8 chars. */
 static char *normalize_key(context_t *ctx, token_t strtok) {
   const char *sp = strtok.ptr;
@@ -649,7 +876,7 @@ static char *normalize_key(context_t *ctx, token_t strtok) {
       }
     } else {
       /* for double quote, we need to normalize */
-      ret = norm_basic_str(sp, sq - sp, multiline, ebuf, sizeof(ebuf));
+      ret = norm_basic_str(sp, sq - sp, multiline, 0, ebuf, sizeof(ebuf));
       if (!ret) {
         e_syntax(ctx, lineno, ebuf);
         return 0;
@@ -685,6 +912,145 @@ static char *normalize_key(context_t *ctx, token_t strtok) {
   return ret;
 }
 
+/* Tables with more than INDEX_MIN keys are looked up through an
+ * open-addressing hash index. It is built on the first lookup and
+ * brought up to date on each lookup with the entries appended since,
+ * so building a table of N keys costs O(N) instead of O(N^2). The load
+ * factor is kept at or below 1/2.
+ */
+#define INDEX_MIN 8
+
+static uint32_t key_hash(const char *key) {
+  uint32_t h = 2166136261u; /* FNV-1a */
+  for (; *key; key++)
+    h = (h ^ (unsigned char)*key) * 16777619u;
+  return h;
+}
+
+static const char *entry_key(const toml_table_t *tab, int kind, int i) {
+  if (kind == 0)
+    return tab->kval[i]->key;
+  if (kind == 1)
+    return tab->arr[i]->key;
+  return tab->tab[i]->key;
+}
+
+/* Add the entries missing from the index of tab, rebuilding it if it
+ * would get more than half full. Return -1 if out of memory.
+ */
+static int index_update(toml_table_t *tab) {
+  const int count[3] = {tab->nkval, tab->narr, tab->ntab};
+  const int n = count[0] + count[1] + count[2];
+
+  if (tab->index &&
+      n == tab->nindex[0] + tab->nindex[1] + tab->nindex[2])
+    return 0;
+
+  if (!tab->index || n > tab->nslot / 2) {
+    int nslot = 16;
+    while (nslot / 2 < n) {
+      if (nslot > INT_MAX / 2 / (int)sizeof(toml_index_t))
+        return -1;
+      nslot *= 2;
+    }
+    toml_index_t *index = CALLOC(nslot, sizeof(toml_index_t));
+    if (!index)
+      return -1;
+    xfree(tab->index);
+    tab->index = index;
+    tab->nslot = nslot;
+    memset(tab->nindex, 0, sizeof(tab->nindex));
+  }
+
+  for (int kind = 0; kind < 3; kind++) {
+    for (int i = tab->nindex[kind]; i < count[kind]; i++) {
+      uint32_t h = key_hash(entry_key(tab, kind, i));
+      int j = h & (tab->nslot - 1);
+      while (tab->index[j].ref)
+        j = (j + 1) & (tab->nslot - 1);
+      tab->index[j].hash = h;
+      tab->index[j].ref = ((uint32_t)i << 2 | kind) + 1;
+    }
+    tab->nindex[kind] = count[kind];
+  }
+  return 0;
+}
+
+/* Look up key in tab. Return 0 if not found, or 'v'alue, 'a'rray or
+ * 't'able depending on the element, and its position in *idx. The
+ * index is a cache, it is updated even through a const table.
+ */
+static int table_find(const toml_table_t *ctab, const char *key, int *idx) {
+  toml_table_t *tab = (toml_table_t *)(intptr_t)ctab;
+  static const char kinds[3] = {'v', 'a', 't'};
+  int i;
+
+  if (tab->nkval + tab->narr + tab->ntab > INDEX_MIN &&
+      index_update(tab) == 0) {
+    const uint32_t h = key_hash(key);
+    const int mask = tab->nslot - 1;
+
+    for (i = h & mask; tab->index[i].ref; i = (i + 1) & mask) {
+      const uint32_t ref = tab->index[i].ref - 1;
+      if (tab->index[i].hash == h &&
+          0 == strcmp(key, entry_key(tab, ref & 3, ref >> 2))) {
+        *idx = ref >> 2;
+        return kinds[ref & 3];
+      }
+    }
+    return 0;
+  }
+
+  for (i = 0; i < tab->nkval; i++) {
+    if (0 == strcmp(key, tab->kval[i]->key)) {
+      *idx = i;
+      return 'v';
+    }
+  }
+  for (i = 0; i < tab->narr; i++) {
+    if (0 == strcmp(key, tab->arr[i]->key)) {
+      *idx = i;
+      return 'a';
+    }
+  }
+  for (i = 0; i < tab->ntab; i++) {
+    if (0 == strcmp(key, tab->tab[i]->key)) {
+      *idx = i;
+      return 't';
+    }
+  }
+  return 0;
+}
+
+/* Bring the indexes of a tree up to date, so that lookups in a tree
+ * built in an arena never allocate outside of it.
+ */
+static int index_array(toml_array_t *arr);
+
+static int index_tree(toml_table_t *tab) {
+  int i;
+
+  if (tab->nkval + tab->narr + tab->ntab > INDEX_MIN && index_update(tab))
+    return -1;
+  for (i = 0; i < tab->narr; i++)
+    if (index_array(tab->arr[i]))
+      return -1;
+  for (i = 0; i < tab->ntab; i++)
+    if (index_tree(tab->tab[i]))
+      return -1;
+  return 0;
+}
+
+static int index_array(toml_array_t *arr) {
+  for (int i = 0; i < arr->nitem; i++) {
+    if (arr->item[i].tab && index_tree(arr->item[i].tab))
+      return -1;
+    if (arr->item[i].arr && index_array(arr->item[i].arr))
+      return -1;
+  }
+  return 0;
+}
+
 /*
  * Look up key in tab. Return 0 if not found, or
  * 'v'alue, 'a'rray or 't'able depending on the element.
@@ -692,7 +1058,7 @@ static char *normalize_key(context_t *ctx, token_t strtok) {
 static int check_key(toml_table_t *tab, const char *key,
                      toml_keyval_t **ret_val, toml_array_t **ret_arr,
                      toml_table_t **ret_tab) {
-  int i;
+  int i = 0, kind;
   void *dummy;
 
   if (!ret_tab)
@@ -706,25 +1072,18 @@ static int check_key(toml_table_t *tab, const char *key,
   *ret_arr = 0;
   *ret_val = 0;
 
-  for (i = 0; i < tab->nkval; i++) {
-    if (0 == strcmp(key, tab->kval[i]->key)) {
-      *ret_val = tab->kval[i];
-      return 'v';
-    }
-  }
-  for (i = 0; i < tab->narr; i++) {
-    if (0 == strcmp(key, tab->arr[i]->key)) {
-      *ret_arr = tab->arr[i];
-      return 'a';
-    }
-  }
-  for (i = 0; i < tab->ntab; i++) {
-    if (0 == strcmp(key, tab->tab[i]->key)) {
-      *ret_tab = tab->tab[i];
-      return 't';
-    }
+  switch (kind = table_find(tab, key, &i)) {
+  case 'v':
+    *ret_val = tab->kval[i];
+    break;
+  case 'a':
+    *ret_arr = tab->arr[i];
+    break;
+  case 't':
+    *ret_tab = tab->tab[i];
+    break;
   }
-  return 0;
+  return kind;
 }
 
 static int key_kind(toml_table_t *tab, const char *key) {
@@ -1033,6 +1392,8 @@ static int parse_array(context_t *ctx, toml_array_t *arr) {
 
       if (!(newval->val = STRNDUP(val, vlen)))
         return e_outofmemory(ctx, FLINE);
+      if (set_strview(&newval->sv, newval->val, vlen))
+        return e_outofmemory(ctx, FLINE);
 
       newval->valtype = valtype(newval->val);
 
@@ -1157,6 +1518,8 @@ static int parse_keyval(context_t *ctx, toml_table_t *tab) {
     assert(keyval->val == 0);
     if (!(keyval->val = STRNDUP(val.ptr, val.len)))
       return e_outofmemory(ctx, FLINE);
+    if (set_strview(&keyval->sv, keyval->val, val.len))
+      return e_outofmemory(ctx, FLINE);
 
     if (next_token(ctx, 1))
       return -1;
@@ -1401,6 +1764,7 @@ static int parse_select(context_t *ctx) {
 
 toml_table_t *toml_parse(char *conf, char *errbuf, int errbufsz) {
   context_t ctx;
+  toml_chunk_t *chunks = 0;
 
   // clear errbuf
   if (errbufsz <= 0)
@@ -1422,9 +1786,13 @@ toml_table_t *toml_parse(char *conf, char *errbuf, int errbufsz) {
   ctx.tok.len = 0;
 
   // make a root table
+  if (arena_mode)
+    cur_arena = &chunks;
   if (0 == (ctx.root = CALLOC(1, sizeof(*ctx.root)))) {
     e_outofmemory(&ctx, FLINE);
     // Do not goto fail, root table not set up yet
+    cur_arena = 0;
+    arena_free(chunks);
     return 0;
   }
 
@@ -1467,97 +1835,975 @@ toml_table_t *toml_parse(char *conf, char *errbuf, int errbufsz) {
   /* success */
   for (int i = 0; i < ctx.tpath.top; i++)
     xfree(ctx.tpath.key[i]);
+  if (cur_arena && index_tree(ctx.root)) {
+    e_outofmemory(&ctx, FLINE);
+    goto fail;
+  }
+  cur_arena = 0;
+  ctx.root->arena = chunks;
   return ctx.root;
 
 fail:
   // Something bad has happened. Free resources and return error.
   for (int i = 0; i < ctx.tpath.top; i++)
     xfree(ctx.tpath.key[i]);
-  toml_free(ctx.root);
+  cur_arena = 0;
+  if (chunks)
+    arena_free(chunks);
+  else
+    toml_free(ctx.root);
   return 0;
 }
 
-toml_table_t *toml_parse_file(FILE *fp, char *errbuf, int errbufsz) {
-  int bufsz = 0;
-  char *buf = 0;
-  int off = 0;
+/* Event parser: the grammar of toml_parse() walked without a tree.
+ * Keys and string values are seen in place when they have no escapes,
+ * the others are unescaped into copies freed once the handler returns.
+ */
+typedef struct event_ctx_t event_ctx_t;
+struct event_ctx_t {
+  context_t ctx;
+  toml_handler_t handler;
+  void *arg;
+  int stopped; /* value returned by the handler, if not 0 */
+  toml_event_t ev;
+  char *norm[TOML_EVENT_MAXKEY + 2]; /* copies to free after the event */
+  int nnorm;
+};
 
-  /* read from fp into buf */
-  while (!feof(fp)) {
+static void event_clear(event_ctx_t *ec) {
+  for (int i = 0; i < ec->nnorm; i++)
+    xfree(ec->norm[i]);
+  ec->nnorm = 0;
+  ec->ev.nkey = 0;
+}
 
-    if (off == bufsz) {
-      int xsz = bufsz + 1000;
-      char *x = expand(buf, bufsz, xsz);
-      if (!x) {
-        snprintf(errbuf, errbufsz, "out of memory");
-        xfree(buf);
-        return 0;
-      }
-      buf = x;
-      bufsz = xsz;
-    }
+/* Set *v to the string token tok of ctx, or to the unescaped copy kept
+ * in ec->norm[]. Invalid strings leave v->ok at 0. */
+static int event_str(event_ctx_t *ec, token_t tok, toml_view_t *v) {
+  toml_strview_t sv;
 
-    errno = 0;
-    int n = fread(buf + off, 1, bufsz - off, fp);
-    if (ferror(fp)) {
-      snprintf(errbuf, errbufsz, "%s",
-               errno ? strerror(errno) : "Error reading file");
-      xfree(buf);
-      return 0;
-    }
-    off += n;
-  }
+  memset(v, 0, sizeof(*v));
+  memset(&sv, 0, sizeof(sv));
+  if (set_strview(&sv, tok.ptr, tok.len))
+    return e_outofmemory(&ec->ctx, FLINE);
+  if (!sv.ptr)
+    return 0;
+  if (sv.norm)
+    ec->norm[ec->nnorm++] = sv.norm;
+  v->ok = 1;
+  v->ptr = sv.ptr;
+  v->len = sv.len;
+  return 0;
+}
 
-  /* tag on a NUL to cap the string */
-  if (off == bufsz) {
-    int xsz = bufsz + 1;
-    char *x = expand(buf, bufsz, xsz);
-    if (!x) {
-      snprintf(errbuf, errbufsz, "out of memory");
-      xfree(buf);
+/* Set *v to the key token tok, checked like normalize_key() does. */
+static int event_key(event_ctx_t *ec, token_t tok, toml_view_t *v) {
+  if (*tok.ptr == '\'' || *tok.ptr == '"') {
+    if (event_str(ec, tok, v))
+      return -1;
+    if (!v->ok) {
+      /* normalize_key() lets more through, or tells what is wrong */
+      char *key = normalize_key(&ec->ctx, tok);
+      if (!key)
+        return -1;
+      ec->norm[ec->nnorm++] = key;
+      v->ok = 1;
+      v->ptr = key;
+      v->len = strlen(key);
       return 0;
     }
-    buf = x;
-    bufsz = xsz;
+    if (memchr(v->ptr, '\n', v->len))
+      return e_badkey(&ec->ctx, tok.lineno);
+    return 0;
   }
-  buf[off] = 0;
+  for (int i = 0; i < tok.len; i++)
+    if (!isalnum(tok.ptr[i]) && tok.ptr[i] != '_' && tok.ptr[i] != '-')
+      return e_badkey(&ec->ctx, tok.lineno);
+  v->ok = 1;
+  v->ptr = tok.ptr;
+  v->len = tok.len;
+  return 0;
+}
 
-  /* parse it, cleanup and finish */
-  toml_table_t *ret = toml_parse(buf, errbuf, errbufsz);
-  xfree(buf);
+/* Check the key token tok without keeping it. */
+static int event_check_key(event_ctx_t *ec, token_t tok) {
+  toml_view_t v;
+  int nnorm = ec->nnorm;
+  int ret = event_key(ec, tok, &v);
+
+  while (ec->nnorm > nnorm)
+    xfree(ec->norm[--ec->nnorm]);
   return ret;
 }
 
-static void xfree_kval(toml_keyval_t *p) {
-  if (!p)
-    return;
-  xfree(p->key);
-  xfree(p->val);
-  xfree(p);
+/* Add the key token tok to the key path of the event. */
+static int event_path(event_ctx_t *ec, token_t tok) {
+  if (ec->ev.nkey >= TOML_EVENT_MAXKEY)
+    return e_syntax(&ec->ctx, tok.lineno,
+                    "key path is too deep; max allowed is 10.");
+  if (event_key(ec, tok, &ec->ev.key[ec->ev.nkey]))
+    return -1;
+  ec->ev.nkey++;
+  return 0;
 }
 
-static void xfree_tab(toml_table_t *p);
-
-static void xfree_arr(toml_array_t *p) {
-  if (!p)
-    return;
-
-  xfree(p->key);
-  const int n = p->nitem;
-  for (int i = 0; i < n; i++) {
-    toml_arritem_t *a = &p->item[i];
-    if (a->val)
-      xfree(a->val);
-    else if (a->arr)
-      xfree_arr(a->arr);
-    else if (a->tab)
-      xfree_tab(a->tab);
+static int event_emit(event_ctx_t *ec) {
+  int ret = ec->handler(ec->arg, &ec->ev);
+  event_clear(ec);
+  if (ret) {
+    ec->stopped = ret;
+    return -1;
   }
-  xfree(p->item);
-  xfree(p);
+  return 0;
 }
 
-static void xfree_tab(toml_table_t *p) {
+static int event_value(event_ctx_t *ec, const char **endp);
+
+/* We are at '[...]' in a value: check it up to its ']'. */
+static int event_array(event_ctx_t *ec, const char **endp) {
+  context_t *ctx = &ec->ctx;
+
+  if (eat_token(ctx, LBRACKET, 0, FLINE))
+    return -1;
+  for (;;) {
+    if (skip_newlines(ctx, 0))
+      return -1;
+    if (ctx->tok.tok == RBRACKET)
+      break;
+    switch (ctx->tok.tok) {
+    case STRING:
+      if (eat_token(ctx, STRING, 0, FLINE))
+        return -1;
+      break;
+    case LBRACKET:
+    case LBRACE:
+      if (event_value(ec, endp))
+        return -1;
+      break;
+    default:
+      return e_syntax(ctx, ctx->tok.lineno, "syntax error");
+    }
+    if (skip_newlines(ctx, 0))
+      return -1;
+    if (ctx->tok.tok == COMMA) {
+      if (eat_token(ctx, COMMA, 0, FLINE))
+        return -1;
+      continue;
+    }
+    break;
+  }
+  *endp = ctx->tok.ptr + 1;
+  return eat_token(ctx, RBRACKET, 1, FLINE);
+}
+
+/* We are at '{ ... }' in a value: check it up to its '}'. */
+static int event_inline_table(event_ctx_t *ec, const char **endp) {
+  context_t *ctx = &ec->ctx;
+
+  if (eat_token(ctx, LBRACE, 1, FLINE))
+    return -1;
+  for (;;) {
+    if (ctx->tok.tok == NEWLINE)
+      return e_syntax(ctx, ctx->tok.lineno,
+                      "newline not allowed in inline table");
+    if (ctx->tok.tok == RBRACE)
+      break;
+    if (ctx->tok.tok != STRING)
+      return e_syntax(ctx, ctx->tok.lineno, "expect a string");
+    token_t tok = ctx->tok;
+    for (;;) {
+      if (next_token(ctx, 1))
+        return -1;
+      if (ctx->tok.tok != DOT)
+        break;
+      if (event_check_key(ec, tok) || next_token(ctx, 1))
+        return -1;
+      if (ctx->tok.tok != STRING)
+        return e_syntax(ctx, ctx->tok.lineno, "syntax error");
+      tok = ctx->tok;
+    }
+    if (ctx->tok.tok != EQUAL)
+      return e_syntax(ctx, ctx->tok.lineno, "missing =");
+    if (next_token(ctx, 0) || event_check_key(ec, tok))
+      return -1;
+    if (event_value(ec, endp))
+      return -1;
+    if (ctx->tok.tok == NEWLINE)
+      return e_syntax(ctx, ctx->tok.lineno,
+                      "newline not allowed in inline table");
+    if (ctx->tok.tok == COMMA) {
+      if (eat_token(ctx, COMMA, 1, FLINE))
+        return -1;
+      continue;
+    }
+    break;
+  }
+  *endp = ctx->tok.ptr + 1;
+  return eat_token(ctx, RBRACE, 1, FLINE);
+}
+
+/* We are at a value: a string token, an array or an inline table. Set
+ * *endp to its end. */
+static int event_value(event_ctx_t *ec, const char **endp) {
+  context_t *ctx = &ec->ctx;
+
+  switch (ctx->tok.tok) {
+  case STRING:
+    *endp = ctx->tok.ptr + ctx->tok.len;
+    return next_token(ctx, 1);
+  case LBRACKET:
+    return event_array(ec, endp);
+  case LBRACE:
+    return event_inline_table(ec, endp);
+  default:
+    return e_syntax(ctx, ctx->tok.lineno, "syntax error");
+  }
+}
+
+/* key = value, or a.b.c = value */
+static int event_keyval(event_ctx_t *ec) {
+  context_t *ctx = &ec->ctx;
+  toml_event_t *ev = &ec->ev;
+  const char *end;
+
+  ev->type = TOML_EVENT_KEYVAL;
+  ev->lineno = ctx->tok.lineno;
+  /* keys are checked in the order of parse_keyval(), the last one once
+   * the value is scanned */
+  token_t key = ctx->tok;
+  for (;;) {
+    if (next_token(ctx, 1))
+      return -1;
+    if (ctx->tok.tok != DOT)
+      break;
+    if (event_path(ec, key) || next_token(ctx, 1))
+      return -1;
+    if (ctx->tok.tok != STRING)
+      return e_syntax(ctx, ctx->tok.lineno, "syntax error");
+    key = ctx->tok;
+  }
+  if (ctx->tok.tok != EQUAL)
+    return e_syntax(ctx, ctx->tok.lineno, "missing =");
+  if (next_token(ctx, 0) || event_path(ec, key))
+    return -1;
+
+  token_t val = ctx->tok;
+  if (event_value(ec, &end))
+    return -1;
+  ev->raw.ok = 1;
+  ev->raw.ptr = val.ptr;
+  ev->raw.len = end - val.ptr;
+  memset(&ev->str, 0, sizeof(ev->str));
+  if (val.tok == STRING && event_str(ec, val, &ev->str))
+    return -1;
+  return event_emit(ec);
+}
+
+/* [x.y.z] or [[x.y.z]] */
+static int event_select(event_ctx_t *ec) {
+  context_t *ctx = &ec->ctx;
+  toml_event_t *ev = &ec->ev;
+  int lineno = ctx->tok.lineno;
+
+  /* see parse_select() */
+  int llb = (ctx->tok.ptr + 1 < ctx->stop && ctx->tok.ptr[1] == '[');
+
+  if (eat_token(ctx, LBRACKET, 1, FLINE))
+    return -1;
+  if (llb && eat_token(ctx, LBRACKET, 1, FLINE))
+    return -1;
+
+  ev->type = llb ? TOML_EVENT_ARRAY_TABLE : TOML_EVENT_TABLE;
+  ev->lineno = lineno;
+  memset(&ev->raw, 0, sizeof(ev->raw));
+  memset(&ev->str, 0, sizeof(ev->str));
+  for (;;) {
+    if (ctx->tok.tok != STRING)
+      return e_syntax(ctx, lineno, "invalid or missing key");
+    if (event_path(ec, ctx->tok))
+      return -1;
+    if (next_token(ctx, 1))
+      return -1;
+    if (ctx->tok.tok == RBRACKET)
+      break;
+    if (ctx->tok.tok != DOT)
+      return e_syntax(ctx, lineno, "invalid key");
+    if (next_token(ctx, 1))
+      return -1;
+  }
+
+  if (llb) {
+    if (!(ctx->tok.ptr + 1 < ctx->stop && ctx->tok.ptr[1] == ']'))
+      return e_syntax(ctx, ctx->tok.lineno, "expects ]]");
+    if (eat_token(ctx, RBRACKET, 1, FLINE))
+      return -1;
+  }
+  if (eat_token(ctx, RBRACKET, 1, FLINE))
+    return -1;
+  if (ctx->tok.tok != NEWLINE)
+    return e_syntax(ctx, ctx->tok.lineno, "extra chars after ] or ]]");
+  return event_emit(ec);
+}
+
+int toml_parse_events(char *conf, toml_handler_t handler, void *arg,
+                      char *errbuf, int errbufsz) {
+  event_ctx_t ec;
+  context_t *ctx = &ec.ctx;
+  int ret = 0;
+
+  if (errbufsz <= 0)
+    errbufsz = 0;
+  if (errbufsz > 0)
+    errbuf[0] = 0;
+
+  memset(&ec, 0, sizeof(ec));
+  ec.handler = handler;
+  ec.arg = arg;
+  ctx->start = conf;
+  ctx->stop = ctx->start + strlen(conf);
+  ctx->errbuf = errbuf;
+  ctx->errbufsz = errbufsz;
+
+  // start with an artificial newline of length 0, as toml_parse()
+  ctx->tok.tok = NEWLINE;
+  ctx->tok.lineno = 1;
+  ctx->tok.ptr = conf;
+  ctx->tok.len = 0;
+
+  for (token_t tok = ctx->tok; !tok.eof; tok = ctx->tok) {
+    switch (tok.tok) {
+    case NEWLINE:
+      ret = next_token(ctx, 1);
+      break;
+
+    case STRING:
+      if ((ret = event_keyval(&ec)))
+        break;
+      if (ctx->tok.tok != NEWLINE) {
+        ret = e_syntax(ctx, ctx->tok.lineno, "extra chars after value");
+        break;
+      }
+      ret = eat_token(ctx, NEWLINE, 1, FLINE);
+      break;
+
+    case LBRACKET:
+      ret = event_select(&ec);
+      break;
+
+    default:
+      ret = e_syntax(ctx, tok.lineno, "syntax error");
+    }
+    if (ret)
+      break;
+  }
+  event_clear(&ec);
+  return ec.stopped ? ec.stopped : ret;
+}
+
+/* Read the rest of fp into a NUL terminated buffer and set *lenp to its
+ * length. Regular files are read at once into a buffer sized by fstat();
+ * streams, and files that grew meanwhile, grow the buffer geometrically.
+ * Files are not mapped: one rewritten in place (as on a reload) would
+ * fault past its new end, or lose the NUL after its old one.
+ */
+static char *read_file(FILE *fp, int *lenp, char *errbuf, int errbufsz) {
+  int bufsz = 4096;
+  char *buf = 0;
+  int off = 0;
+  struct stat st;
+
+  if (fileno(fp) >= 0 && fstat(fileno(fp), &st) == 0) {
+    long pos = ftell(fp);
+    if (S_ISREG(st.st_mode) && pos >= 0 && pos <= st.st_size &&
+        st.st_size - pos < INT_MAX - 1)
+      bufsz = st.st_size - pos + 1;
+  }
+
+  buf = MALLOC(bufsz);
+  if (!buf) {
+    snprintf(errbuf, errbufsz, "out of memory");
+    return 0;
+  }
+
+  /* read from fp into buf */
+  while (!feof(fp)) {
+
+    if (off == bufsz) {
+      int xsz = bufsz * 2;
+      char *x = bufsz <= INT_MAX / 2 ? expand(buf, off, xsz) : 0;
+      if (!x) {
+        snprintf(errbuf, errbufsz, "out of memory");
+        xfree(buf);
+        return 0;
+      }
+      buf = x;
+      bufsz = xsz;
+    }
+
+    errno = 0;
+    int n = fread(buf + off, 1, bufsz - off, fp);
+    if (ferror(fp)) {
+      snprintf(errbuf, errbufsz, "%s",
+               errno ? strerror(errno) : "Error reading file");
+      xfree(buf);
+      return 0;
+    }
+    off += n;
+  }
+
+  /* tag on a NUL to cap the string */
+  if (off == bufsz) {
+    int xsz = bufsz + 1;
+    char *x = bufsz < INT_MAX ? expand(buf, off, xsz) : 0;
+    if (!x) {
+      snprintf(errbuf, errbufsz, "out of memory");
+      xfree(buf);
+      return 0;
+    }
+    buf = x;
+    bufsz = xsz;
+  }
+  buf[off] = 0;
+  *lenp = off;
+  return buf;
+}
+
+toml_table_t *toml_parse_file(FILE *fp, char *errbuf, int errbufsz) {
+  int len;
+  char *buf = read_file(fp, &len, errbuf, errbufsz);
+  if (!buf)
+    return 0;
+
+  /* parse it, cleanup and finish */
+  toml_table_t *ret = toml_parse(buf, errbuf, errbufsz);
+  xfree(buf);
+  return ret;
+}
+
+/* Precompiled images. A parse tree is serialized into one block, with
+ * every pointer stored as an offset from the start of the block and
+ * listed in a relocation table, so the image does not depend on where
+ * it is loaded. toml_parse_cached() maps the image privately and adds
+ * the address of the mapping to the listed pointers, after which the
+ * tree is an ordinary one and all the accessors work on it unchanged.
+ * Relocating is a single pass over the pointers, much cheaper than
+ * tokenizing and parsing the source.
+ *
+ * The image is keyed by a hash of the source text and records the sizes
+ * of the node structures, so that a stale image or one written by a
+ * build with another layout is ignored and rewritten. A checksum of the
+ * body catches a damaged file, and the relocated tree is walked before
+ * use: every node, pointer array and string must lie inside the mapping
+ * and every count and index agree, or the source is parsed instead.
+ */
+#define IMAGE_MAGIC "TOMLIMG"
+#define IMAGE_VERSION 2
+
+typedef struct image_hdr_t image_hdr_t;
+struct image_hdr_t {
+  char magic[8];
+  uint32_t version;
+  uint16_t layout[6]; /* pointer and node structure sizes */
+  uint64_t hash;      /* of the source text */
+  uint64_t srclen;
+  uint64_t size; /* of the whole image */
+  uint64_t root; /* offset of the root table */
+  uint64_t reloc; /* offset of the relocation table */
+  uint64_t nreloc;
+  uint64_t sum; /* image_hash() of what follows the header */
+};
+
+typedef struct image_t image_t;
+struct image_t {
+  char *buf;
+  size_t len, cap;
+  uint64_t *reloc;
+  size_t nreloc, relcap;
+  int err;
+};
+
+static void image_layout(uint16_t layout[6]) {
+  layout[0] = sizeof(void *);
+  layout[1] = sizeof(toml_table_t);
+  layout[2] = sizeof(toml_keyval_t);
+  layout[3] = sizeof(toml_array_t);
+  layout[4] = sizeof(toml_arritem_t);
+  layout[5] = sizeof(toml_index_t);
+}
+
+static uint64_t image_hash(const char *p, size_t len) {
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+  uint64_t w;
+  size_t i;
+
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0x100000001b3ull;
+    h ^= h >> 29;
+  }
+  for (w = 0; i < len; i++)
+    w = w << 8 | (unsigned char)p[i];
+  h = (h ^ w) * 0x100000001b3ull;
+  return h ^ h >> 32;
+}
+
+/* Reserve len zeroed bytes, 8-aligned, and return their offset. */
+static size_t image_alloc(image_t *im, size_t len) {
+  size_t off = ALIGN8(im->len);
+
+  if (im->err)
+    return 0;
+  if (off + len > im->cap) {
+    size_t cap = im->cap ? im->cap : 4096;
+    while (cap < off + len)
+      cap *= 2;
+    char *x = cap <= INT_MAX ? expand(im->buf, im->cap, cap) : 0;
+    if (!x) {
+      im->err = 1;
+      return 0;
+    }
+    im->buf = x;
+    im->cap = cap;
+  }
+  memset(im->buf + im->len, 0, off + len - im->len);
+  im->len = off + len;
+  return off;
+}
+
+/* Store the offset target in the pointer at offset field. */
+static void image_ptr(image_t *im, size_t field, size_t target) {
+  if (im->err)
+    return;
+  if (im->nreloc == im->relcap) {
+    size_t cap = im->relcap ? im->relcap * 2 : 256;
+    uint64_t *x = cap <= INT_MAX / sizeof(uint64_t)
+                      ? expand(im->reloc, im->relcap * sizeof(uint64_t),
+                               cap * sizeof(uint64_t))
+                      : 0;
+    if (!x) {
+      im->err = 1;
+      return;
+    }
+    im->reloc = x;
+    im->relcap = cap;
+  }
+  uintptr_t v = target;
+  memcpy(im->buf + field, &v, sizeof(v));
+  im->reloc[im->nreloc++] = field;
+}
+
+static size_t image_str(image_t *im, const char *s, size_t len) {
+  size_t off = image_alloc(im, len + 1);
+  if (!im->err)
+    memcpy(im->buf + off, s, len);
+  return off;
+}
+
+/* Strings and their views, at offset off of their container. */
+static void image_val(image_t *im, size_t off, const char *val,
+                      const toml_strview_t *sv, size_t valfield,
+                      size_t svfield) {
+  size_t v = image_str(im, val, strlen(val));
+  image_ptr(im, off + valfield, v);
+  if (sv->norm) {
+    size_t n = image_str(im, sv->norm, sv->len);
+    image_ptr(im, off + svfield + offsetof(toml_strview_t, ptr), n);
+    image_ptr(im, off + svfield + offsetof(toml_strview_t, norm), n);
+  } else if (sv->ptr) {
+    image_ptr(im, off + svfield + offsetof(toml_strview_t, ptr),
+              v + (sv->ptr - val));
+  }
+}
+
+static size_t image_tab(image_t *im, const toml_table_t *t);
+
+static size_t image_arr(image_t *im, const toml_array_t *a) {
+  size_t off = image_alloc(im, sizeof(*a));
+  if (im->err)
+    return 0;
+  toml_array_t tmp = *a;
+  tmp.key = 0;
+  tmp.item = 0;
+  memcpy(im->buf + off, &tmp, sizeof(tmp));
+  if (a->key)
+    image_ptr(im, off + offsetof(toml_array_t, key),
+              image_str(im, a->key, strlen(a->key)));
+  if (a->nitem == 0)
+    return off;
+
+  size_t items = image_alloc(im, a->nitem * sizeof(toml_arritem_t));
+  image_ptr(im, off + offsetof(toml_array_t, item), items);
+  for (int i = 0; i < a->nitem && !im->err; i++) {
+    const toml_arritem_t *it = &a->item[i];
+    size_t o = items + i * sizeof(toml_arritem_t);
+    toml_arritem_t x;
+    memset(&x, 0, sizeof(x));
+    x.valtype = it->valtype;
+    x.sv.len = it->sv.len;
+    memcpy(im->buf + o, &x, sizeof(x));
+    if (it->val)
+      image_val(im, o, it->val, &it->sv, offsetof(toml_arritem_t, val),
+                offsetof(toml_arritem_t, sv));
+    else if (it->arr)
+      image_ptr(im, o + offsetof(toml_arritem_t, arr), image_arr(im, it->arr));
+    else if (it->tab)
+      image_ptr(im, o + offsetof(toml_arritem_t, tab), image_tab(im, it->tab));
+  }
+  return off;
+}
+
+static size_t image_kval(image_t *im, const toml_keyval_t *kv) {
+  size_t off = image_alloc(im, sizeof(*kv));
+  if (im->err)
+    return 0;
+  toml_keyval_t tmp;
+  memset(&tmp, 0, sizeof(tmp));
+  tmp.sv.len = kv->sv.len;
+  memcpy(im->buf + off, &tmp, sizeof(tmp));
+  image_ptr(im, off + offsetof(toml_keyval_t, key),
+            image_str(im, kv->key, strlen(kv->key)));
+  if (kv->val)
+    image_val(im, off, kv->val, &kv->sv, offsetof(toml_keyval_t, val),
+              offsetof(toml_keyval_t, sv));
+  return off;
+}
+
+/* An array of n pointers to the nodes returned by fn. */
+#define IMAGE_PTRARR(im, field, n, p, fn)                                      \
+  do {                                                                         \
+    if ((n) > 0) {                                                             \
+      size_t a_ = image_alloc(im, (n) * sizeof(void *));                       \
+      image_ptr(im, field, a_);                                                \
+      for (int i_ = 0; i_ < (n) && !(im)->err; i_++)                           \
+        image_ptr(im, a_ + i_ * sizeof(void *), fn(im, (p)[i_]));              \
+    }                                                                          \
+  } while (0)
+
+static size_t image_tab(image_t *im, const toml_table_t *t) {
+  size_t off = image_alloc(im, sizeof(*t));
+  if (im->err)
+    return 0;
+  toml_table_t tmp = *t;
+  tmp.key = 0;
+  tmp.kval = 0;
+  tmp.arr = 0;
+  tmp.tab = 0;
+  tmp.index = 0;
+  tmp.arena = 0;
+  tmp.image = 0;
+  tmp.imagesz = 0;
+  memcpy(im->buf + off, &tmp, sizeof(tmp));
+  if (t->key)
+    image_ptr(im, off + offsetof(toml_table_t, key),
+              image_str(im, t->key, strlen(t->key)));
+  IMAGE_PTRARR(im, off + offsetof(toml_table_t, kval), t->nkval, t->kval,
+               image_kval);
+  IMAGE_PTRARR(im, off + offsetof(toml_table_t, arr), t->narr, t->arr,
+               image_arr);
+  IMAGE_PTRARR(im, off + offsetof(toml_table_t, tab), t->ntab, t->tab,
+               image_tab);
+  if (t->index) {
+    size_t x = image_alloc(im, t->nslot * sizeof(toml_index_t));
+    if (!im->err)
+      memcpy(im->buf + x, t->index, t->nslot * sizeof(toml_index_t));
+    image_ptr(im, off + offsetof(toml_table_t, index), x);
+  }
+  return off;
+}
+
+/* Write the image of tab to path, through a temporary file renamed into
+ * place. Failing to write it is not an error, the cache is just missed
+ * next time.
+ */
+static void image_write(const char *path, toml_table_t *tab, uint64_t hash,
+                        size_t srclen) {
+  image_t im;
+  image_hdr_t hdr;
+  char tmp[1024];
+  int fd;
+
+  /* complete the indexes, lookups must not allocate in the image */
+  if (index_tree(tab))
+    return;
+
+  memset(&im, 0, sizeof(im));
+  image_alloc(&im, sizeof(hdr));
+  size_t root = image_tab(&im, tab);
+  size_t reloc = image_alloc(&im, im.nreloc * sizeof(uint64_t));
+  if (im.err)
+    goto done;
+  if (im.nreloc)
+    memcpy(im.buf + reloc, im.reloc, im.nreloc * sizeof(uint64_t));
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+  hdr.version = IMAGE_VERSION;
+  image_layout(hdr.layout);
+  hdr.hash = hash;
+  hdr.srclen = srclen;
+  hdr.size = im.len;
+  hdr.root = root;
+  hdr.reloc = reloc;
+  hdr.nreloc = im.nreloc;
+  hdr.sum = image_hash(im.buf + sizeof(hdr), im.len - sizeof(hdr));
+  memcpy(im.buf, &hdr, sizeof(hdr));
+
+  /* a new file of our own, complete on disk before it replaces the
+   * image: a crash leaves either image whole */
+  if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+    goto done;
+  if ((fd = mkstemp(tmp)) < 0)
+    goto done;
+  for (size_t off = 0; off < im.len;) {
+    ssize_t n = write(fd, im.buf + off, im.len - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      goto fail;
+    off += n;
+  }
+  if (fsync(fd))
+    goto fail;
+  if (close(fd)) {
+    fd = -1;
+    goto fail;
+  }
+  if (rename(tmp, path))
+    unlink(tmp);
+  goto done;
+
+fail:
+  if (fd >= 0)
+    close(fd);
+  unlink(tmp);
+
+done:
+  xfree(im.buf);
+  xfree(im.reloc);
+}
+
+/* Bounds of a relocated image, for the checks below. Nodes are written
+ * after their parent, which the checks require so that a damaged image
+ * cannot send the walk round in circles.
+ */
+typedef struct image_chk_t image_chk_t;
+struct image_chk_t {
+  const char *base, *end;
+};
+
+/* Whether [p, p + len) is inside the image, p aligned on align. */
+static int image_in(const image_chk_t *c, const void *p, size_t len,
+                    size_t align) {
+  const char *q = p;
+  return q && q >= c->base && q <= c->end && (size_t)(c->end - q) >= len &&
+         (uintptr_t)q % align == 0;
+}
+
+static int image_chk_str(const image_chk_t *c, const char *s) {
+  return image_in(c, s, 1, 1) && memchr(s, 0, c->end - s);
+}
+
+static int image_chk_val(const image_chk_t *c, const char *val,
+                         const toml_strview_t *sv) {
+  if (val && !image_chk_str(c, val))
+    return 0;
+  if (sv->len < 0)
+    return 0;
+  if (sv->norm)
+    return sv->ptr == sv->norm && image_in(c, sv->norm, sv->len + 1, 1);
+  return !sv->ptr || image_in(c, sv->ptr, sv->len, 1);
+}
+
+static int image_chk_tab(const image_chk_t *c, const toml_table_t *t,
+                         const void *parent);
+
+static int image_chk_arr(const image_chk_t *c, const toml_array_t *a,
+                         const void *parent) {
+  if ((const void *)a <= parent || !image_in(c, a, sizeof(*a), 8) ||
+      (a->key && !image_chk_str(c, a->key)) || a->nitem < 0 ||
+      (a->nitem &&
+       !image_in(c, a->item, a->nitem * sizeof(toml_arritem_t), 8)))
+    return 0;
+  for (int i = 0; i < a->nitem; i++) {
+    const toml_arritem_t *it = &a->item[i];
+    if (!image_chk_val(c, it->val, &it->sv) ||
+        (it->arr && !image_chk_arr(c, it->arr, a)) ||
+        (it->tab && !image_chk_tab(c, it->tab, a)))
+      return 0;
+  }
+  return 1;
+}
+
+static int image_chk_tab(const image_chk_t *c, const toml_table_t *t,
+                         const void *parent) {
+  int i, kind;
+
+  if ((const void *)t <= parent || !image_in(c, t, sizeof(*t), 8) ||
+      (t->key && !image_chk_str(c, t->key)) || t->arena)
+    return 0;
+  const int count[3] = {t->nkval, t->narr, t->ntab};
+  const void *const *ptrs[3] = {(const void *const *)t->kval,
+                                (const void *const *)t->arr,
+                                (const void *const *)t->tab};
+  for (kind = 0; kind < 3; kind++)
+    if (count[kind] < 0 ||
+        (count[kind] &&
+         !image_in(c, ptrs[kind], count[kind] * sizeof(void *), 8)))
+      return 0;
+  for (i = 0; i < t->nkval; i++) {
+    const toml_keyval_t *kv = t->kval[i];
+    if ((const void *)kv <= (const void *)t ||
+        !image_in(c, kv, sizeof(*kv), 8) || !image_chk_str(c, kv->key) ||
+        !image_chk_val(c, kv->val, &kv->sv))
+      return 0;
+  }
+  for (i = 0; i < t->narr; i++)
+    if (!image_chk_arr(c, t->arr[i], t) || !t->arr[i]->key)
+      return 0;
+  for (i = 0; i < t->ntab; i++)
+    if (!image_chk_tab(c, t->tab[i], t) || !t->tab[i]->key)
+      return 0;
+
+  /* the writer completes the indexes: lookups must find them whole,
+   * with a free slot to end each probe */
+  if (!t->index)
+    return count[0] + count[1] + count[2] <= INDEX_MIN;
+  if (t->nslot <= 0 || (t->nslot & (t->nslot - 1)) ||
+      !image_in(c, t->index, t->nslot * sizeof(toml_index_t), 4) ||
+      count[0] + count[1] + count[2] > t->nslot / 2)
+    return 0;
+  for (kind = 0; kind < 3; kind++)
+    if (t->nindex[kind] != count[kind])
+      return 0;
+  for (i = 0; i < t->nslot; i++) {
+    uint32_t ref = t->index[i].ref - 1;
+    if (t->index[i].ref &&
+        ((ref & 3) > 2 || (ref >> 2) >= (uint32_t)count[ref & 3]))
+      return 0;
+  }
+  return 1;
+}
+
+/* Map the image at path and relocate it, if it is valid and its key
+ * matches. Return its root table, or 0.
+ */
+static toml_table_t *image_load(const char *path, uint64_t hash,
+                                size_t srclen) {
+  image_hdr_t hdr;
+  uint16_t layout[6];
+  struct stat st;
+  char *base;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(hdr) ||
+      st.st_size > INT_MAX) {
+    close(fd);
+    return 0;
+  }
+  base = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return 0;
+
+  const size_t size = st.st_size;
+  memcpy(&hdr, base, sizeof(hdr));
+  image_layout(layout);
+  if (memcmp(hdr.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) ||
+      hdr.version != IMAGE_VERSION ||
+      memcmp(hdr.layout, layout, sizeof(layout)) || hdr.hash != hash ||
+      hdr.srclen != srclen || hdr.size != size ||
+      hdr.root + sizeof(toml_table_t) > size || hdr.root % 8 ||
+      hdr.reloc % 8 || hdr.reloc > size ||
+      hdr.nreloc > (size - hdr.reloc) / sizeof(uint64_t) ||
+      hdr.sum != image_hash(base + sizeof(hdr), size - sizeof(hdr)))
+    goto bad;
+
+  const uint64_t *reloc = (const uint64_t *)(base + hdr.reloc);
+  for (uint64_t i = 0; i < hdr.nreloc; i++) {
+    uintptr_t v;
+    if (reloc[i] > size - sizeof(v))
+      goto bad;
+    memcpy(&v, base + reloc[i], sizeof(v));
+    if (v >= size)
+      goto bad;
+    v += (uintptr_t)base;
+    memcpy(base + reloc[i], &v, sizeof(v));
+  }
+
+  const image_chk_t chk = {base, base + size};
+  toml_table_t *root = (toml_table_t *)(base + hdr.root);
+  if (!image_chk_tab(&chk, root, base))
+    goto bad;
+  root->image = base;
+  root->imagesz = size;
+  return root;
+
+bad:
+  munmap(base, size);
+  return 0;
+}
+
+toml_table_t *toml_parse_cached(const char *path, const char *cache,
+                                char *errbuf, int errbufsz) {
+  FILE *fp;
+  int len;
+
+  if (errbufsz > 0)
+    errbuf[0] = 0;
+  if (!(fp = fopen(path, "r"))) {
+    snprintf(errbuf, errbufsz, "%s", strerror(errno));
+    return 0;
+  }
+  char *buf = read_file(fp, &len, errbuf, errbufsz);
+  fclose(fp);
+  if (!buf)
+    return 0;
+
+  uint64_t hash = image_hash(buf, len);
+  toml_table_t *ret = cache ? image_load(cache, hash, len) : 0;
+  if (!ret) {
+    ret = toml_parse(buf, errbuf, errbufsz);
+    if (ret && cache)
+      image_write(cache, ret, hash, len);
+  }
+  xfree(buf);
+  return ret;
+}
+
+static void xfree_kval(toml_keyval_t *p) {
+  if (!p)
+    return;
+  xfree(p->key);
+  xfree(p->val);
+  xfree(p->sv.norm);
+  xfree(p);
+}
+
+static void xfree_tab(toml_table_t *p);
+
+static void xfree_arr(toml_array_t *p) {
+  if (!p)
+    return;
+
+  xfree(p->key);
+  const int n = p->nitem;
+  for (int i = 0; i < n; i++) {
+    toml_arritem_t *a = &p->item[i];
+    if (a->val) {
+      xfree(a->val);
+      xfree(a->sv.norm);
+    } else if (a->arr)
+      xfree_arr(a->arr);
+    else if (a->tab)
+      xfree_tab(a->tab);
+  }
+  xfree(p->item);
+  xfree(p);
+}
+
+static void xfree_tab(toml_table_t *p) {
   int i;
 
   if (!p)
@@ -1577,10 +2823,18 @@ static void xfree_tab(toml_table_t *p) {
     xfree_tab(p->tab[i]);
   xfree(p->tab);
 
+  xfree(p->index);
   xfree(p);
 }
 
-void toml_free(toml_table_t *tab) { xfree_tab(tab); }
+void toml_free(toml_table_t *tab) {
+  if (tab && tab->image)
+    munmap(tab->image, tab->imagesz);
+  else if (tab && tab->arena)
+    arena_free(tab->arena);
+  else
+    xfree_tab(tab);
+}
 
 static void set_token(context_t *ctx, tokentype_t tok, int lineno, char *ptr,
                       int len) {
@@ -1598,6 +2852,267 @@ static void set_eof(context_t *ctx, int lineno) {
   ctx->tok.eof = 1;
 }
 
+#ifdef VEC_X86
+/* UTF-8 validation by table lookups on the high and low nibbles of each
+ * byte and the high nibble of the next one, after Keiser and Lemire,
+ * "Validating UTF-8 in less than one instruction per byte" (2021). Each
+ * table gives the errors possible for a nibble, and a pair of bytes is
+ * bad when the three agree on one.
+ */
+#define U8_TOO_SHORT (1 << 0) /* lead not followed by a continuation */
+#define U8_TOO_LONG (1 << 1)  /* continuation after an ASCII byte */
+#define U8_OVERLONG_3 (1 << 2)
+#define U8_TOO_LARGE (1 << 3) /* above U+10FFFF */
+#define U8_SURROGATE (1 << 4)
+#define U8_OVERLONG_2 (1 << 5)
+#define U8_TOO_LARGE_1000 (1 << 6)
+#define U8_OVERLONG_4 (1 << 6)
+#define U8_TWO_CONTS (1 << 7) /* continuation after a continuation */
+#define U8_CARRY (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+#define U8_LARGE (U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000)
+
+static const uint8_t u8_byte1_high[16] = {
+    U8_TOO_LONG,  U8_TOO_LONG,  U8_TOO_LONG,  U8_TOO_LONG,
+    U8_TOO_LONG,  U8_TOO_LONG,  U8_TOO_LONG,  U8_TOO_LONG,
+    U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+    U8_TOO_SHORT | U8_OVERLONG_2,
+    U8_TOO_SHORT,
+    U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+    U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4};
+
+static const uint8_t u8_byte1_low[16] = {
+    U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+    U8_CARRY | U8_OVERLONG_2,
+    U8_CARRY,
+    U8_CARRY,
+    U8_CARRY | U8_TOO_LARGE,
+    U8_LARGE,
+    U8_LARGE,
+    U8_LARGE,
+    U8_LARGE,
+    U8_LARGE,
+    U8_LARGE,
+    U8_LARGE,
+    U8_LARGE,
+    U8_LARGE | U8_SURROGATE,
+    U8_LARGE,
+    U8_LARGE};
+
+static const uint8_t u8_byte2_high[16] = {
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 |
+        U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+    U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+    U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT};
+
+/* Largest byte allowed in each of the last 3 positions of a block
+ * without a sequence going on in the next one; the tail of the array is
+ * loaded. */
+static const uint8_t u8_max[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1};
+
+#define vec_t __m128i
+#define VEC_LEN 16
+#define VEC_ALL 0xffffu
+#define vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vec_set1(c) _mm_set1_epi8(c)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm_cmpgt_epi8(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_and(a, b) _mm_and_si128(a, b)
+#define vec_mask(a) ((uint32_t)_mm_movemask_epi8(a))
+#define VEC_FN(name) name##_sse2
+#define VEC_TARGET
+#define VEC_SCAN
+#include "toml_vec.h"
+
+#define vec_t __m128i
+#define VEC_LEN 16
+#define VEC_ALL 0xffffu
+#define vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vec_set1(c) _mm_set1_epi8(c)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_and(a, b) _mm_and_si128(a, b)
+#define vec_mask(a) ((uint32_t)_mm_movemask_epi8(a))
+#define vec_xor(a, b) _mm_xor_si128(a, b)
+#define vec_subs(a, b) _mm_subs_epu8(a, b)
+#define vec_table(t) _mm_loadu_si128((t))
+#define vec_lookup(t, x) _mm_shuffle_epi8(t, x)
+#define vec_hi4(x) vec_and(_mm_srli_epi16(x, 4), vec_set1(0x0f))
+#define vec_prev(x, prev, n) _mm_alignr_epi8(x, prev, 16 - (n))
+#define VEC_FN(name) name##_ssse3
+#define VEC_TARGET __attribute__((target("ssse3")))
+#define VEC_UTF8
+#include "toml_vec.h"
+
+#define vec_t __m256i
+#define VEC_LEN 32
+#define VEC_ALL 0xffffffffu
+#define vec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define vec_set1(c) _mm256_set1_epi8(c)
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm256_cmpgt_epi8(a, b)
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_and(a, b) _mm256_and_si256(a, b)
+#define vec_mask(a) ((uint32_t)_mm256_movemask_epi8(a))
+#define vec_xor(a, b) _mm256_xor_si256(a, b)
+#define vec_subs(a, b) _mm256_subs_epu8(a, b)
+#define vec_table(t) _mm256_broadcastsi128_si256(_mm_loadu_si128((t)))
+#define vec_lookup(t, x) _mm256_shuffle_epi8(t, x)
+#define vec_hi4(x) vec_and(_mm256_srli_epi16(x, 4), vec_set1(0x0f))
+#define vec_prev(x, prev, n)                                                   \
+  _mm256_alignr_epi8(x, _mm256_permute2x128_si256(prev, x, 0x21), 16 - (n))
+#define VEC_FN(name) name##_avx2
+#define VEC_TARGET __attribute__((target("avx2")))
+#define VEC_SCAN
+#define VEC_UTF8
+#include "toml_vec.h"
+
+static int vec_avx2;  /* whether to use the _avx2 loops */
+static int vec_ssse3; /* whether to use the _ssse3 validator */
+
+/* Before main(), so that threads parsing at once see them set. */
+__attribute__((constructor)) static void vec_init(void) {
+  __builtin_cpu_init();
+  vec_avx2 = __builtin_cpu_supports("avx2");
+  vec_ssse3 = __builtin_cpu_supports("ssse3");
+}
+#endif
+
+/* Spans of the tokenizer. Most tokens are short: the first SCAN_HEAD
+ * chars are looked at one by one, then the vector loops handle whole
+ * blocks before stop and leave the rest to the scalar loops, which give
+ * the result on their own when there is no vector support. Results are
+ * the same either way.
+ */
+#define SCAN_HEAD 16
+
+static const char *scan_head(const char *p, const char *stop) {
+  return stop - p > SCAN_HEAD ? p + SCAN_HEAD : stop;
+}
+
+/* First char of [p, stop) among c1..c4 (repeat one to look for fewer),
+ * or stop. */
+static char *scan_any(char *p, const char *stop, char c1, char c2, char c3,
+                      char c4) {
+  for (const char *head = scan_head(p, stop); p < head; p++)
+    if (*p == c1 || *p == c2 || *p == c3 || *p == c4)
+      return p;
+#ifdef VEC_X86
+  p = vec_avx2 ? scan_any_avx2(p, stop, c1, c2, c3, c4)
+               : scan_any_sse2(p, stop, c1, c2, c3, c4);
+#endif
+  for (; p < stop; p++)
+    if (*p == c1 || *p == c2 || *p == c3 || *p == c4)
+      break;
+  return p;
+}
+
+/* First char of [p, stop) that is not a space, tab or CR, or stop. */
+static char *skip_blank(char *p, const char *stop) {
+  for (const char *head = scan_head(p, stop); p < head; p++)
+    if (*p != ' ' && *p != '\t' && *p != '\r')
+      return p;
+#ifdef VEC_X86
+  p = vec_avx2 ? skip_blank_avx2(p, stop) : skip_blank_sse2(p, stop);
+#endif
+  for (; p < stop; p++)
+    if (*p != ' ' && *p != '\t' && *p != '\r')
+      break;
+  return p;
+}
+
+/* Whether ch can be part of a bare key or value: A-Z a-z 0-9 + - _ and
+ * . unless dotisspecial. A macro to stay cheap in unoptimized builds. */
+#define IS_BARE(ch, dotisspecial)                                              \
+  (('A' <= (ch) && (ch) <= 'Z') || ('a' <= (ch) && (ch) <= 'z') ||             \
+   ('0' <= (ch) && (ch) <= '9') || (ch) == '+' || (ch) == '-' ||               \
+   (ch) == '_' || ((ch) == '.' && !(dotisspecial)))
+
+/* First char of [p, stop) that is not IS_BARE(), or stop. */
+static char *scan_bare(char *p, const char *stop, int dotisspecial) {
+  for (const char *head = scan_head(p, stop); p < head; p++)
+    if (!IS_BARE(*p, dotisspecial))
+      return p;
+#ifdef VEC_X86
+  p = vec_avx2 ? scan_bare_avx2(p, stop, dotisspecial)
+               : scan_bare_sse2(p, stop, dotisspecial);
+#endif
+  for (; p < stop; p++)
+    if (!IS_BARE(*p, dotisspecial))
+      break;
+  return p;
+}
+
+/* Number of newlines in [p, p + n). */
+static int count_newlines(const char *p, int n) {
+  const char *stop = p + n;
+  int count = 0;
+#ifdef VEC_X86
+  if (n > SCAN_HEAD)
+    p = vec_avx2 ? count_newlines_avx2(p, stop, &count)
+                 : count_newlines_sse2(p, stop, &count);
+#endif
+  for (; p < stop; p++)
+    count += (*p == '\n');
+  return count;
+}
+
+/* Whether [p, p + len) is valid UTF-8: no overlong forms, surrogates
+ * or code points above U+10FFFF. ASCII is skipped a block at a time. */
+static int utf8_valid(const char *s, int len) {
+  const unsigned char *p = (const unsigned char *)s, *stop = p + len;
+
+#ifdef VEC_X86
+  p = vec_avx2 ? skip_ascii_avx2(p, stop) : skip_ascii_sse2(p, stop);
+#endif
+  for (; p < stop && *p < 0x80; p++)
+    ;
+  if (p == stop)
+    return 1;
+#ifdef VEC_X86
+  if (vec_avx2)
+    return utf8_valid_avx2((const char *)p, (const char *)stop);
+  if (vec_ssse3)
+    return utf8_valid_ssse3((const char *)p, (const char *)stop);
+#endif
+  while (p < stop) {
+    int n;
+    unsigned lo = 0x80, hi = 0xbf;
+    if (*p < 0x80) {
+      p++;
+      continue;
+    }
+    if (*p < 0xc2)
+      return 0;
+    if (*p < 0xe0)
+      n = 1;
+    else if (*p < 0xf0) {
+      n = 2;
+      lo = (*p == 0xe0) ? 0xa0 : 0x80;
+      hi = (*p == 0xed) ? 0x9f : 0xbf;
+    } else if (*p < 0xf5) {
+      n = 3;
+      lo = (*p == 0xf0) ? 0x90 : 0x80;
+      hi = (*p == 0xf4) ? 0x8f : 0xbf;
+    } else
+      return 0;
+    if (stop - p <= n || p[1] < lo || p[1] > hi)
+      return 0;
+    for (int i = 2; i <= n; i++)
+      if ((p[i] & 0xc0) != 0x80)
+        return 0;
+    p += n + 1;
+  }
+  return 1;
+}
+
 /* Scan p for n digits compositing entirely of [0-9] */
 static int scan_digits(const char *p, int n) {
   int ret = 0;
@@ -1650,6 +3165,8 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
       break;
     }
 
+    if (!utf8_valid(orig, q + 3 - orig))
+      return e_syntax(ctx, lineno, "invalid UTF-8");
     set_token(ctx, STRING, lineno, orig, q + 3 - orig);
     return 0;
   }
@@ -1676,6 +3193,9 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
     int hexreq = 0; /* #hex required */
     int escape = 0;
     for (p += 3; p < q; p++) {
+      if (!escape && !hexreq &&
+          (p = scan_any(p, q, '\\', '\\', '\\', '\\')) == q)
+        break;
       if (escape) {
         escape = 0;
         if (strchr("btnfr\"\\", *p))
@@ -1708,17 +3228,20 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
     if (hexreq)
       return e_syntax(ctx, lineno, "expected more hex char");
 
+    if (!utf8_valid(orig, q + 3 - orig))
+      return e_syntax(ctx, lineno, "invalid UTF-8");
     set_token(ctx, STRING, lineno, orig, q + 3 - orig);
     return 0;
   }
 
   if ('\'' == *p) {
-    for (p++; *p && *p != '\n' && *p != '\''; p++)
-      ;
+    p = scan_any(p + 1, ctx->stop, '\n', '\'', '\'', '\'');
     if (*p != '\'') {
       return e_syntax(ctx, lineno, "unterminated s-quote");
     }
 
+    if (!utf8_valid(orig, p + 1 - orig))
+      return e_syntax(ctx, lineno, "invalid UTF-8");
     set_token(ctx, STRING, lineno, orig, p + 1 - orig);
     return 0;
   }
@@ -1727,6 +3250,9 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
     int hexreq = 0; /* #hex required */
     int escape = 0;
     for (p++; *p; p++) {
+      if (!escape && !hexreq &&
+          !*(p = scan_any(p, ctx->stop, '\\', '\'', '\n', '"')))
+        break;
       if (escape) {
         escape = 0;
         if (strchr("btnfr\"\\", *p))
@@ -1766,6 +3292,8 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
       return e_syntax(ctx, lineno, "unterminated quote");
     }
 
+    if (!utf8_valid(orig, p + 1 - orig))
+      return e_syntax(ctx, lineno, "invalid UTF-8");
     set_token(ctx, STRING, lineno, orig, p + 1 - orig);
     return 0;
   }
@@ -1783,18 +3311,7 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
   }
 
   /* literals */
-  for (; *p && *p != '\n'; p++) {
-    int ch = *p;
-    if (ch == '.' && dotisspecial)
-      break;
-    if ('A' <= ch && ch <= 'Z')
-      continue;
-    if ('a' <= ch && ch <= 'z')
-      continue;
-    if (strchr("0123456789+-_.", ch))
-      continue;
-    break;
-  }
+  p = scan_bare(p, ctx->stop, dotisspecial);
 
   set_token(ctx, STRING, lineno, orig, p - orig);
   return 0;
@@ -1803,20 +3320,16 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
 static int next_token(context_t *ctx, int dotisspecial) {
   int lineno = ctx->tok.lineno;
   char *p = ctx->tok.ptr;
-  int i;
 
   /* eat this tok */
-  for (i = 0; i < ctx->tok.len; i++) {
-    if (*p++ == '\n')
-      lineno++;
-  }
+  lineno += count_newlines(p, ctx->tok.len);
+  p += ctx->tok.len;
 
   /* make next tok */
   while (p < ctx->stop) {
     /* skip comment. stop just before the \n. */
     if (*p == '#') {
-      for (p++; p < ctx->stop && *p != '\n'; p++)
-        ;
+      p = scan_any(p + 1, ctx->stop, '\n', '\n', '\n', '\n');
       continue;
     }
 
@@ -1851,7 +3364,7 @@ static int next_token(context_t *ctx, int dotisspecial) {
     case ' ':
     case '\t':
       /* ignore white spaces */
-      p++;
+      p = skip_blank(p + 1, ctx->stop);
       continue;
     }
 
@@ -1879,45 +3392,27 @@ const char *toml_key_in(const toml_table_t *tab, int keyidx) {
 
 int toml_key_exists(const toml_table_t *tab, const char *key) {
   int i;
-  for (i = 0; i < tab->nkval; i++) {
-    if (0 == strcmp(key, tab->kval[i]->key))
-      return 1;
-  }
-  for (i = 0; i < tab->narr; i++) {
-    if (0 == strcmp(key, tab->arr[i]->key))
-      return 1;
-  }
-  for (i = 0; i < tab->ntab; i++) {
-    if (0 == strcmp(key, tab->tab[i]->key))
-      return 1;
-  }
-  return 0;
+  return table_find(tab, key, &i) != 0;
 }
 
 toml_raw_t toml_raw_in(const toml_table_t *tab, const char *key) {
   int i;
-  for (i = 0; i < tab->nkval; i++) {
-    if (0 == strcmp(key, tab->kval[i]->key))
-      return tab->kval[i]->val;
-  }
+  if (table_find(tab, key, &i) == 'v')
+    return tab->kval[i]->val;
   return 0;
 }
 
 toml_array_t *toml_array_in(const toml_table_t *tab, const char *key) {
   int i;
-  for (i = 0; i < tab->narr; i++) {
-    if (0 == strcmp(key, tab->arr[i]->key))
-      return tab->arr[i];
-  }
+  if (table_find(tab, key, &i) == 'a')
+    return tab->arr[i];
   return 0;
 }
 
 toml_table_t *toml_table_in(const toml_table_t *tab, const char *key) {
   int i;
-  for (i = 0; i < tab->ntab; i++) {
-    if (0 == strcmp(key, tab->tab[i]->key))
-      return tab->tab[i];
-  }
+  if (table_find(tab, key, &i) == 't')
+    return tab->tab[i];
   return 0;
 }
 
@@ -2058,11 +3553,11 @@ int toml_rtob(toml_raw_t src, int *ret_) {
   int dummy;
   int *ret = ret_ ? ret_ : &dummy;
 
-  if (0 == strcmp(src, "true")) {
+  if (src[0] == 't' && 0 == strcmp(src, "true")) {
     *ret = 1;
     return 0;
   }
-  if (0 == strcmp(src, "false")) {
+  if (src[0] == 'f' && 0 == strcmp(src, "false")) {
     *ret = 0;
     return 0;
   }
@@ -2082,6 +3577,22 @@ int toml_rtoi(toml_raw_t src, int64_t *ret_) {
   int64_t dummy;
   int64_t *ret = ret_ ? ret_ : &dummy;
 
+  /* fast path: up to 18 decimal digits without underscores, which
+   * cannot overflow, converted without the copy into buf */
+  if (s[0] == '+' || s[0] == '-')
+    s++;
+  if ('1' <= s[0] && s[0] <= '9') {
+    int64_t v = 0;
+    int n;
+    for (n = 0; n < 18 && '0' <= s[n] && s[n] <= '9'; n++)
+      v = v * 10 + (s[n] - '0');
+    if (s[n] == 0) {
+      *ret = src[0] == '-' ? -v : v;
+      return 0;
+    }
+  }
+  s = src;
+
   /* allow +/- */
   if (s[0] == '+' || s[0] == '-')
     *p++ = *s++;
@@ -2216,38 +3727,9 @@ int toml_rtos(toml_raw_t src, char **ret) {
   if (!src)
     return -1;
 
-  // for strings, first char must be a s-quote or d-quote
-  int qchar = src[0];
-  int srclen = strlen(src);
-  if (!(qchar == '\'' || qchar == '"')) {
+  int qchar = str_bounds(src, strlen(src), &sp, &sq, &multiline);
+  if (!qchar)
     return -1;
-  }
-
-  // triple quotes?
-  if (qchar == src[1] && qchar == src[2]) {
-    multiline = 1;         // triple-quote implies multiline
-    sp = src + 3;          // first char after quote
-    sq = src + srclen - 3; // first char of ending quote
-
-    if (!(sp <= sq && sq[0] == qchar && sq[1] == qchar && sq[2] == qchar)) {
-      // last 3 chars in src must be qchar
-      return -1;
-    }
-
-    /* skip new line immediate after qchar */
-    if (sp[0] == '\n')
-      sp++;
-    else if (sp[0] == '\r' && sp[1] == '\n')
-      sp += 2;
-
-  } else {
-    sp = src + 1;          // first char after quote
-    sq = src + srclen - 1; // ending quote
-    if (!(sp <= sq && *sq == qchar)) {
-      /* last char in src must be qchar */
-      return -1;
-    }
-  }
 
   // at this point:
   //     sp points to first valid char after quote.
@@ -2256,7 +3738,7 @@ int toml_rtos(toml_raw_t src, char **ret) {
   if (qchar == '\'') {
     *ret = norm_lit_str(sp, sq - sp, multiline, 0, 0);
   } else {
-    *ret = norm_basic_str(sp, sq - sp, multiline, 0, 0);
+    *ret = norm_basic_str(sp, sq - sp, multiline, 0, 0, 0);
   }
 
   return *ret ? 0 : -1;
@@ -2269,6 +3751,18 @@ toml_datum_t toml_string_at(const toml_array_t *arr, int idx) {
   return ret;
 }
 
+toml_view_t toml_string_view_at(const toml_array_t *arr, int idx) {
+  toml_view_t ret;
+  memset(&ret, 0, sizeof(ret));
+  if (0 <= idx && idx < arr->nitem && arr->item[idx].val &&
+      arr->item[idx].sv.ptr) {
+    ret.ok = 1;
+    ret.ptr = arr->item[idx].sv.ptr;
+    ret.len = arr->item[idx].sv.len;
+  }
+  return ret;
+}
+
 toml_datum_t toml_bool_at(const toml_array_t *arr, int idx) {
   toml_datum_t ret;
   memset(&ret, 0, sizeof(ret));
@@ -2330,6 +3824,18 @@ toml_datum_t toml_string_in(const toml_table_t *arr, const char *key) {
   return ret;
 }
 
+toml_view_t toml_string_view_in(const toml_table_t *tab, const char *key) {
+  toml_view_t ret;
+  int i;
+  memset(&ret, 0, sizeof(ret));
+  if (table_find(tab, key, &i) == 'v' && tab->kval[i]->sv.ptr) {
+    ret.ok = 1;
+    ret.ptr = tab->kval[i]->sv.ptr;
+    ret.len = tab->kval[i]->sv.len;
+  }
+  return ret;
+}
+
 toml_datum_t toml_bool_in(const toml_table_t *arr, const char *key) {
   toml_datum_t ret;
   memset(&ret, 0, sizeof(ret));
@@ -55,6 +55,15 @@ TOML_EXTERN toml_table_t *toml_parse_file(FILE *fp, char *errbuf, int errbufsz);
 TOML_EXTERN toml_table_t *toml_parse(char *conf, /* NUL terminated, please. */
                                      char *errbuf, int errbufsz);
 
+/* Parse the file at path like toml_parse_file(). If cache is not 0, it
+ * is the path of a precompiled image of the file: the image is mapped
+ * instead of parsing if it was made from the same contents, otherwise
+ * it is rewritten after the parse. The table is used as any other.
+ */
+TOML_EXTERN toml_table_t *toml_parse_cached(const char *path,
+                                            const char *cache,
+                                            char *errbuf, int errbufsz);
+
 /* Free the table returned by toml_parse() or toml_parse_file(). Once
  * this function is called, any handles accessed through this tab
  * directly or indirectly are no longer valid.
@@ -90,11 +99,62 @@ struct toml_datum_t {
   } u;
 };
 
+/* A string value seen in place, without a copy: ptr is not NUL
+ * terminated and stays valid until the tree is freed (see below for
+ * toml_parse_events()).
+ */
+typedef struct toml_view_t toml_view_t;
+struct toml_view_t {
+  int ok;
+  const char *ptr;
+  int len;
+};
+
+/*-----------------------------------------------------------------
+ *  Event parsing: the document is walked without building a tree, a
+ *  handler being called for each table header and key/value. Keys and
+ *  raw values are seen in the NUL terminated conf, except for the keys
+ *  and strings with escapes, which are unescaped into copies valid until
+ *  the handler returns. Keys are not checked for duplicates.
+ */
+#define TOML_EVENT_MAXKEY 10
+
+enum {
+  TOML_EVENT_TABLE = 't',       /* [a.b.c] */
+  TOML_EVENT_ARRAY_TABLE = 'a', /* [[a.b.c]]: a new entry of a.b.c */
+  TOML_EVENT_KEYVAL = 'k',      /* a.b.c = value, in the last table */
+};
+
+typedef struct toml_event_t toml_event_t;
+struct toml_event_t {
+  int type; /* TOML_EVENT_... */
+  int lineno;
+  int nkey;
+  toml_view_t key[TOML_EVENT_MAXKEY]; /* the key path, unquoted */
+  toml_view_t raw; /* value as written: give a NUL terminated copy to
+                      toml_rtoi() and the like; arrays and inline tables
+                      are seen from [ to ] or { to } */
+  toml_view_t str; /* the string value if ok */
+};
+
+/* Return 0 to go on; anything else stops the parse and is returned by
+ * toml_parse_events(). */
+typedef int (*toml_handler_t)(void *arg, const toml_event_t *ev);
+
+/* Parse conf, calling handler(arg, event) along the way. Return 0 on
+ * success, -1 on error with a message in errbuf, or the value of the
+ * handler that stopped the parse.
+ */
+TOML_EXTERN int toml_parse_events(char *conf, /* NUL terminated, please. */
+                                  toml_handler_t handler, void *arg,
+                                  char *errbuf, int errbufsz);
+
 /* on arrays: */
 /* ... retrieve size of array. */
 TOML_EXTERN int toml_array_nelem(const toml_array_t *arr);
 /* ... retrieve values using index. */
 TOML_EXTERN toml_datum_t toml_string_at(const toml_array_t *arr, int idx);
+TOML_EXTERN toml_view_t toml_string_view_at(const toml_array_t *arr, int idx);
 TOML_EXTERN toml_datum_t toml_bool_at(const toml_array_t *arr, int idx);
 TOML_EXTERN toml_datum_t toml_int_at(const toml_array_t *arr, int idx);
 TOML_EXTERN toml_datum_t toml_double_at(const toml_array_t *arr, int idx);
@@ -111,6 +171,8 @@ TOML_EXTERN int toml_key_exists(const toml_table_t *tab, const char *key);
 /* ... retrieve values using key. */
 TOML_EXTERN toml_datum_t toml_string_in(const toml_table_t *arr,
                                         const char *key);
+TOML_EXTERN toml_view_t toml_string_view_in(const toml_table_t *tab,
+                                           const char *key);
 TOML_EXTERN toml_datum_t toml_bool_in(const toml_table_t *arr, const char *key);
 TOML_EXTERN toml_datum_t toml_int_in(const toml_table_t *arr, const char *key);
 TOML_EXTERN toml_datum_t toml_double_in(const toml_table_t *arr,
@@ -158,6 +220,13 @@ TOML_EXTERN int toml_ucs_to_utf8(int64_t code, char buf[6]);
 TOML_EXTERN void toml_set_memutil(void *(*xxmalloc)(size_t),
                                   void (*xxfree)(void *));
 
+/* If enable is non-zero, toml_parse() and toml_parse_file() allocate
+ * the tree from a few large chunks owned by the root table, obtained
+ * through the memutil allocator, and toml_free() releases the chunks.
+ * Values returned by the accessors are allocated one by one as before.
+ */
+TOML_EXTERN void toml_set_arena(int enable);
+
 /*--------------------------------------------------------------
  *  deprecated
  */
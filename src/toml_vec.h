@@ -0,0 +1,147 @@
+/* Vector loops of the TOML tokenizer and UTF-8 validator, included by
+ * toml.c once per instruction set: vec_t, VEC_LEN, VEC_ALL and the vec_*
+ * macros are set for it, VEC_FN(name) names the functions and VEC_TARGET
+ * is their target attribute. The tokenizer loops are built if VEC_SCAN
+ * is defined, the validator if VEC_UTF8 is. Each tokenizer loop goes
+ * through the whole blocks from p and returns where it stopped, at the
+ * char looked for or before the last partial block, the scalar code
+ * going on from there. No include guard: the macros are undefined at
+ * the end for the next instruction set.
+ */
+
+#ifdef VEC_SCAN
+
+/* First char of [p, stop) among c1..c4. */
+static VEC_TARGET char *VEC_FN(scan_any)(char *p, const char *stop, char c1,
+                                         char c2, char c3, char c4) {
+  const vec_t v1 = vec_set1(c1), v2 = vec_set1(c2);
+  const vec_t v3 = vec_set1(c3), v4 = vec_set1(c4);
+  for (; stop - p >= VEC_LEN; p += VEC_LEN) {
+    vec_t x = vec_load(p);
+    uint32_t m = vec_mask(vec_or(vec_or(vec_eq(x, v1), vec_eq(x, v2)),
+                                 vec_or(vec_eq(x, v3), vec_eq(x, v4))));
+    if (m)
+      return p + __builtin_ctz(m);
+  }
+  return p;
+}
+
+/* First char of [p, stop) that is not a space, tab or CR. */
+static VEC_TARGET char *VEC_FN(skip_blank)(char *p, const char *stop) {
+  const vec_t sp = vec_set1(' '), tab = vec_set1('\t'), cr = vec_set1('\r');
+  for (; stop - p >= VEC_LEN; p += VEC_LEN) {
+    vec_t x = vec_load(p);
+    uint32_t m = vec_mask(
+        vec_or(vec_or(vec_eq(x, sp), vec_eq(x, tab)), vec_eq(x, cr)));
+    if (m != VEC_ALL)
+      return p + __builtin_ctz(m ^ VEC_ALL);
+  }
+  return p;
+}
+
+/* First char of [p, stop) that is not IS_BARE(). */
+static VEC_TARGET char *VEC_FN(scan_bare)(char *p, const char *stop,
+                                          int dotisspecial) {
+#define IN_RANGE(x, lo, hi)                                                    \
+  vec_and(vec_gt(x, vec_set1((lo)-1)), vec_gt(vec_set1((hi) + 1), x))
+  const vec_t plus = vec_set1('+'), minus = vec_set1('-');
+  const vec_t under = vec_set1('_'), dot = vec_set1(dotisspecial ? '_' : '.');
+  for (; stop - p >= VEC_LEN; p += VEC_LEN) {
+    vec_t x = vec_load(p);
+    vec_t ok = vec_or(vec_or(IN_RANGE(x, 'A', 'Z'), IN_RANGE(x, 'a', 'z')),
+                      IN_RANGE(x, '0', '9'));
+    ok = vec_or(ok, vec_or(vec_or(vec_eq(x, plus), vec_eq(x, minus)),
+                           vec_or(vec_eq(x, under), vec_eq(x, dot))));
+    uint32_t m = vec_mask(ok);
+    if (m != VEC_ALL)
+      return p + __builtin_ctz(m ^ VEC_ALL);
+  }
+#undef IN_RANGE
+  return p;
+}
+
+/* Add the newlines of the whole blocks of [p, stop) to *count. */
+static VEC_TARGET const char *
+VEC_FN(count_newlines)(const char *p, const char *stop, int *count) {
+  const vec_t nl = vec_set1('\n');
+  for (; stop - p >= VEC_LEN; p += VEC_LEN)
+    *count += __builtin_popcount(vec_mask(vec_eq(vec_load(p), nl)));
+  return p;
+}
+
+/* First block of [p, stop) with a byte that is not ASCII. */
+static VEC_TARGET const unsigned char *
+VEC_FN(skip_ascii)(const unsigned char *p, const unsigned char *stop) {
+  for (; stop - p >= VEC_LEN; p += VEC_LEN)
+    if (vec_mask(vec_load(p)))
+      break;
+  return p;
+}
+#endif /* VEC_SCAN */
+
+#ifdef VEC_UTF8
+/* Whether [p, stop) is valid UTF-8, p at the start of a character. The
+ * last partial block is copied to a buffer padded with NULs, which end
+ * a truncated sequence like any ASCII byte would. */
+static VEC_TARGET int VEC_FN(utf8_valid)(const char *p, const char *stop) {
+  const vec_t t1 = vec_table((const void *)u8_byte1_high);
+  const vec_t t2 = vec_table((const void *)u8_byte1_low);
+  const vec_t t3 = vec_table((const void *)u8_byte2_high);
+  const vec_t max = vec_load(u8_max + sizeof(u8_max) - VEC_LEN);
+  const vec_t zero = vec_set1(0);
+  vec_t prev = zero, incomplete = zero, err = zero;
+  char tail[VEC_LEN];
+
+  while (p < stop) {
+    vec_t x;
+    if (stop - p >= VEC_LEN) {
+      x = vec_load(p);
+    } else {
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, p, stop - p);
+      x = vec_load(tail);
+    }
+    p += VEC_LEN;
+    if (vec_mask(x) == 0) {
+      err = vec_or(err, incomplete);
+      incomplete = zero;
+    } else {
+      vec_t prev1 = vec_prev(x, prev, 1);
+      vec_t sc = vec_and(vec_and(vec_lookup(t1, vec_hi4(prev1)),
+                                 vec_lookup(t2, vec_and(prev1, vec_set1(0x0f)))),
+                         vec_lookup(t3, vec_hi4(x)));
+      /* 3rd and 4th bytes must be continuations, flagged as
+       * U8_TWO_CONTS by the lookups above */
+      vec_t must23 = vec_or(vec_subs(vec_prev(x, prev, 2), vec_set1(0x60)),
+                            vec_subs(vec_prev(x, prev, 3), vec_set1(0x70)));
+      must23 = vec_and(must23, vec_set1((char)0x80));
+      err = vec_or(err, vec_xor(must23, sc));
+      incomplete = vec_subs(x, max);
+    }
+    prev = x;
+  }
+  err = vec_or(err, incomplete);
+  return vec_mask(vec_eq(err, zero)) == VEC_ALL;
+}
+#endif /* VEC_UTF8 */
+
+#undef vec_t
+#undef VEC_LEN
+#undef VEC_ALL
+#undef vec_load
+#undef vec_set1
+#undef vec_eq
+#undef vec_gt
+#undef vec_or
+#undef vec_and
+#undef vec_mask
+#undef vec_xor
+#undef vec_subs
+#undef vec_table
+#undef vec_lookup
+#undef vec_hi4
+#undef vec_prev
+#undef VEC_FN
+#undef VEC_TARGET
+#undef VEC_SCAN
+#undef VEC_UTF8